@@ -160,6 +160,37 @@ void stats_readmiss(uint32_t cpuid)
     }
 }
 
+int stats_writehits(uint32_t cpuid)
+{
+    return (cpuid < num_cpus && stats_percpu != NULL) ? stats_percpu[cpuid].writehit : 0;
+}
+
+int stats_writemisses(uint32_t cpuid)
+{
+    return (cpuid < num_cpus && stats_percpu != NULL) ? stats_percpu[cpuid].writemiss : 0;
+}
+
+int stats_readhits(uint32_t cpuid)
+{
+    return (cpuid < num_cpus && stats_percpu != NULL) ? stats_percpu[cpuid].readhit : 0;
+}
+
+int stats_readmisses(uint32_t cpuid)
+{
+    return (cpuid < num_cpus && stats_percpu != NULL) ? stats_percpu[cpuid].readmiss : 0;
+}
+
+void stats_set(uint32_t cpuid, int readhit, int readmiss, int writehit, int writemiss)
+{
+    if(cpuid < num_cpus && stats_percpu != NULL)
+    {
+        stats_percpu[cpuid].readhit = readhit;
+        stats_percpu[cpuid].readmiss = readmiss;
+        stats_percpu[cpuid].writehit = writehit;
+        stats_percpu[cpuid].writemiss = writemiss;
+    }
+}
+
 TraceFile::TraceFile(const char* filename)
     : m_input(filename, ios::in | ios::binary)
 {
@@ -284,3 +315,145 @@ bool TraceFile::eof() const
 {
     return (m_num_finished == m_positions.size());
 }
+
+bool TraceFile::finished(uint32_t pid) const
+{
+    return pid >= m_positions.size() || m_positions[pid] == (streampos) 0;
+}
+
+// Entries of one processor, buffered in memory and spilled to a temporary
+// file in the byte order of the tracefile
+struct TraceWriter::Stream
+{
+    static const size_t BUFFER_ENTRIES = 65536;
+
+    std::vector<uint32_t> buffer;
+    FILE*                 spill;
+    uint64_t              count;
+
+    void flush()
+    {
+        if(!buffer.empty() && fwrite(&buffer[0], sizeof(uint32_t), buffer.size(), spill) != buffer.size())
+        {
+            throw runtime_error("Unable to write the temporary trace");
+        }
+        buffer.clear();
+    }
+};
+
+TraceWriter::TraceWriter(const char* filename, uint32_t procs_count)
+    : m_filename(filename), m_streams(procs_count), m_closed(false)
+{
+    if(procs_count == 0)
+    {
+        throw runtime_error("Tracefile needs at least one processor");
+    }
+    for(uint32_t i = 0; i < procs_count; i++)
+    {
+        m_streams[i] = new Stream();
+        m_streams[i]->buffer.reserve(Stream::BUFFER_ENTRIES);
+        m_streams[i]->count = 0;
+        m_streams[i]->spill = tmpfile();
+        if(m_streams[i]->spill == NULL)
+        {
+            throw runtime_error("Unable to create a temporary trace");
+        }
+    }
+}
+
+TraceWriter::~TraceWriter()
+{
+    try
+    {
+        close();
+    }
+    catch(exception& e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+    }
+    for(uint32_t i = 0; i < m_streams.size(); i++)
+    {
+        fclose(m_streams[i]->spill);
+        delete m_streams[i];
+    }
+}
+
+void TraceWriter::write(uint32_t pid, const TraceFile::Entry& e)
+{
+    if(pid >= m_streams.size() || m_closed)
+    {
+        return;
+    }
+    Stream& s = *m_streams[pid];
+    s.buffer.push_back(htonl((e.addr & ~0x3UL) | (e.type & 0x3)));
+    s.count++;
+    if(s.buffer.size() == Stream::BUFFER_ENTRIES)
+    {
+        s.flush();
+    }
+}
+
+uint64_t TraceWriter::entries(uint32_t pid) const
+{
+    return pid < m_streams.size() ? m_streams[pid]->count : 0;
+}
+
+void TraceWriter::close()
+{
+    if(m_closed)
+    {
+        return;
+    }
+    m_closed = true;
+
+    // Every trace ends with an end tag, the slots after it are never read
+    uint32_t procs_count = m_streams.size();
+    uint64_t rows = 0;
+    for(uint32_t i = 0; i < procs_count; i++)
+    {
+        Stream& s = *m_streams[i];
+        s.buffer.push_back(htonl(TraceFile::ENTRY_TYPE_END));
+        s.count++;
+        s.flush();
+        rewind(s.spill);
+        if(s.count > rows)
+        {
+            rows = s.count;
+        }
+    }
+
+    FILE* out = fopen(m_filename.c_str(), "wb");
+    if(out == NULL)
+    {
+        throw runtime_error(string("Unable to create file: ") + m_filename);
+    }
+    uint32_t header = htonl(procs_count);
+    bool ok = fwrite("2TRF", 1, 4, out) == 4 && fwrite(&header, sizeof(header), 1, out) == 1;
+
+    // Rows are put together from a block of every trace at once
+    const uint64_t BLOCK_ROWS = 16384;
+    vector<uint32_t> block(BLOCK_ROWS * procs_count);
+    vector<uint32_t> column(BLOCK_ROWS);
+    for(uint64_t row = 0; row < rows && ok; row += BLOCK_ROWS)
+    {
+        uint64_t n = min(BLOCK_ROWS, rows - row);
+        for(uint32_t i = 0; i < procs_count; i++)
+        {
+            Stream& s = *m_streams[i];
+            uint64_t valid = s.count > row ? min(n, s.count - row) : 0;
+            if(valid > 0 && fread(&column[0], sizeof(uint32_t), valid, s.spill) != valid)
+            {
+                ok = false;
+            }
+            for(uint64_t k = 0; k < n; k++)
+            {
+                block[k * procs_count + i] = k < valid ? column[k] : 0;
+            }
+        }
+        ok = ok && fwrite(&block[0], sizeof(uint32_t), n * procs_count, out) == n * procs_count;
+    }
+    if(fclose(out) != 0 || !ok)
+    {
+        throw runtime_error(string("Unable to write file: ") + m_filename);
+    }
+}
@@ -37,6 +37,7 @@
 
 #include <fstream>
 #include <vector>
+#include <string>
 
 // Define fixed-size types
 // Support non-compliant C99 compilers
@@ -81,6 +82,15 @@ void stats_writemiss(uint32_t cpuid);
 void stats_readhit(uint32_t cpuid);
 void stats_readmiss(uint32_t cpuid);
 
+// Returns the current values of the statistic counters for given CPU
+int stats_writehits(uint32_t cpuid);
+int stats_writemisses(uint32_t cpuid);
+int stats_readhits(uint32_t cpuid);
+int stats_readmisses(uint32_t cpuid);
+
+// Sets all statistic counters of given CPU, e.g. from a checkpoint
+void stats_set(uint32_t cpuid, int readhit, int readmiss, int writehit, int writemiss);
+
 class TraceFile
 {
 public:
@@ -117,6 +127,9 @@ public:
     // Determines if the end-of-file has been reached
     bool eof() const;
 
+    // Determines if the trace of processor pid has ended
+    bool finished(uint32_t pid) const;
+
     // Returns the number of processors this file contains traces for
     uint32_t get_proc_count() const;
 
@@ -132,6 +145,39 @@ private:
     TraceFile(const TraceFile& trf);
 };
 
+/*
+ * Writes a tracefile which TraceFile can read. The trace of every processor
+ * is buffered and spilled to its own temporary file, so the traces can be
+ * written at different speeds and from different threads at the same time,
+ * as long as every processor is written by one thread only. close() ends
+ * every trace and interleaves them into the file.
+ */
+class TraceWriter
+{
+public:
+    TraceWriter(const char* filename, uint32_t procs_count);
+    ~TraceWriter();
+
+    // Appends the entry to the trace of processor pid
+    void write(uint32_t pid, const TraceFile::Entry& e);
+
+    // Writes the file, the destructor does it if it wasn't done before
+    void close();
+
+    // Returns the number of entries written for processor pid
+    uint64_t entries(uint32_t pid) const;
+
+private:
+    struct Stream;
+
+    std::string          m_filename;
+    std::vector<Stream*> m_streams;
+    bool                 m_closed;
+
+    // Private copy constructor because no copies are allowed.
+    TraceWriter(const TraceWriter& trw);
+};
+
 // Global value giving the number of CPU's in the simulation
 extern uint32_t   num_cpus;
 
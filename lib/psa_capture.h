@@ -0,0 +1,92 @@
+// Capture of memory traces from a running program. The program says which
+// accesses should be recorded and every thread says which processor of the
+// trace it is, the accesses go to a TraceWriter which writes a tracefile the
+// simulators can run:
+//
+//   psa_capture_begin("app.trf", 4);   // before the threads start
+//   psa_capture_thread(i);             // first thing in thread i
+//   sum += PSA_LOAD(a[k]);             // recorded read of a[k]
+//   PSA_STORE(b[k], sum);              // recorded write of b[k]
+//   psa_capture_compute(10);           // 10 instructions without memory accesses
+//   psa_capture_end();                 // after the threads are joined
+//
+// Accesses of threads which didn't call psa_capture_thread and accesses
+// outside of begin/end are not recorded. Traces have 32-bit addresses, so
+// only the low 32 bits of the host address are kept.
+
+#ifndef PSA_CAPTURE_H
+#define PSA_CAPTURE_H
+
+#include <stdint.h>
+#include "psa.h"
+
+// The writer of the running capture, NULL if there is none
+inline TraceWriter*& psa_capture_writer()
+{
+    static TraceWriter* writer = NULL;
+    return writer;
+}
+
+// Processor of the calling thread, -1 if the thread isn't captured
+inline int& psa_capture_pid()
+{
+    static thread_local int pid = -1;
+    return pid;
+}
+
+inline void psa_capture_begin(const char* filename, uint32_t threads)
+{
+    delete psa_capture_writer();
+    psa_capture_writer() = new TraceWriter(filename, threads);
+}
+
+inline void psa_capture_thread(int pid)
+{
+    psa_capture_pid() = pid;
+}
+
+inline void psa_capture_access(const volatile void* ptr, bool write)
+{
+    TraceWriter* writer = psa_capture_writer();
+    if(writer == NULL || psa_capture_pid() < 0)
+        return;
+    TraceFile::Entry e;
+    e.addr = (uint32_t)(uintptr_t)ptr;
+    e.type = write ? TraceFile::ENTRY_TYPE_WRITE : TraceFile::ENTRY_TYPE_READ;
+    writer->write(psa_capture_pid(), e);
+}
+
+inline void psa_capture_compute(unsigned int instructions)
+{
+    TraceWriter* writer = psa_capture_writer();
+    if(writer == NULL || psa_capture_pid() < 0)
+        return;
+    TraceFile::Entry e;
+    e.addr = 0;
+    e.type = TraceFile::ENTRY_TYPE_NOP;
+    for(unsigned int i = 0; i < instructions; i++)
+        writer->write(psa_capture_pid(), e);
+}
+
+// Writes the tracefile, the threads must not record anymore
+inline void psa_capture_end()
+{
+    TraceWriter* writer = psa_capture_writer();
+    psa_capture_writer() = NULL;
+    if(writer != NULL)
+        writer->close();
+    delete writer;
+}
+
+// The value is an argument, so the loads it does are recorded before the store
+template <typename T, typename V>
+inline T& psa_store(T& x, const V& value)
+{
+    psa_capture_access(&x, true);
+    return x = value;
+}
+
+#define PSA_LOAD(x)         (psa_capture_access(&(x), false), (x))
+#define PSA_STORE(x, value) psa_store((x), (value))
+
+#endif
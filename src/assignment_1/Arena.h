@@ -0,0 +1,82 @@
+#ifndef ARENA_MOD
+#define ARENA_MOD
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <stdexcept>
+
+// Owner of the objects which live as long as the model (modules, signals of
+// the cores). Objects are constructed one after another in big chunks instead
+// of one heap allocation each, so the parts of one core sit next to each other,
+// and the arena destroys them in the reverse order when it goes away.
+// Objects never move, pointers to them stay valid.
+class Arena {
+    public:
+    explicit Arena(size_t chunk_size_ = 1 << 20)
+    : chunk_size(chunk_size_), used(0), next(NULL), left(0) {}
+
+    ~Arena(){
+        for(size_t i = objects.size(); i > 0; --i)
+            objects[i - 1].destroy(objects[i - 1].object);
+        for(size_t i = 0; i < chunks.size(); ++i)
+            free(chunks[i]);
+    }
+
+    template <class T, class... Args>
+    T* create(Args&&... args){
+        T* object = new(allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        object_t o = {object, &destroy<T>};
+        objects.push_back(o);
+        return object;
+    }
+
+    size_t bytes() const{ return used; }
+
+    private:
+    struct object_t {
+        void* object;
+        void (*destroy)(void*);
+    };
+
+    size_t chunk_size;
+    size_t used;                // bytes handed out, padding included
+    char* next;                 // free space of the last chunk
+    size_t left;
+    std::vector<char*> chunks;
+    std::vector<object_t> objects;
+
+    template <class T>
+    static void destroy(void* object){
+        static_cast<T*>(object)->~T();
+    }
+
+    void* allocate(size_t size, size_t align){
+        size_t padding = (align - (uintptr_t)next % align) % align;
+        if(next == NULL || padding + size > left){
+            // the rest of the chunk is wasted, objects bigger than a chunk get their own
+            size_t bytes = std::max(chunk_size, size + align);
+            char* chunk = (char*)malloc(bytes);
+            if(chunk == NULL)
+                throw std::bad_alloc();
+            chunks.push_back(chunk);
+            next = chunk;
+            left = bytes;
+            padding = (align - (uintptr_t)next % align) % align;
+        }
+        char* p = next + padding;
+        next = p + size;
+        left -= padding + size;
+        used += padding + size;
+        return p;
+    }
+
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+};
+
+#endif
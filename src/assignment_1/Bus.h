@@ -5,12 +5,20 @@
 #include <atomic>
 #include <queue>
 #include <systemc.h>
+#include "SnoopFilter.h"
+#include "Protocol.h"
+#include "Clock.h"
+#include "CacheArray.h"
+#include "Checkpoint.h"
+#include "MemoryMap.h"
+#include "Config.h"
 
 struct request {
     int id;
     int sourceid;
     int addr;
     int func;
+    cacheline_data data; // written back or updated cacheline
 };
 
 enum Function
@@ -21,25 +29,91 @@ enum Function
     FUNC_INVALIDATE,
     FUNC_RESPONSE,
     FUNC_REQUESTED,
+    FUNC_UPDATE,
 };
 
+// Bus transactions by type, to compare coherence protocols and topologies
+struct bus_traffic_t {
+    unsigned long reads;
+    unsigned long writebacks;
+    unsigned long invalidates;
+    unsigned long updates;
+    unsigned long c2c;
+    unsigned long responses;
+};
+
+// Occupancy of a bus segment by transaction type, for the whole run and for
+// the intervals of the time series. The bus is held from winning the
+// arbitration until it's released, that's counted in clock edges (half cycles).
+// Waiting requestors are the ones which tried to get the bus and lost, every
+// one counts once per cycle however often it tries.
+enum BusTransaction
+{
+    BUS_TX_READ,
+    BUS_TX_WRITEBACK,
+    BUS_TX_INVALIDATE,
+    BUS_TX_UPDATE,
+    BUS_TX_C2C,
+    BUS_TX_RESPONSE,
+    BUS_TX_COUNT,
+};
+static const char* const BUS_TX_NAMES[BUS_TX_COUNT] = {"read", "writeback", "invalidate", "update", "c2c", "response"};
+
+struct bus_usage_t {
+    uint64_t busy[BUS_TX_COUNT]; // edges the bus was held
+    uint64_t bytes;              // cachelines moved over the data wires
+    uint64_t waiting;            // sum over cycles of waiting requestors
+    uint64_t max_waiting;        // most requestors waiting in one cycle
+};
+
+// Every access a cache has in flight is a requestor of its own, so the
+// responses of overlapped misses (out-of-order CPU) don't collide. Slot 0
+// is the cache itself, so the in-order model keeps the CPU numbers.
+static const int MAX_REQUESTORS = MAX_CPUS * MAX_MSHRS;
+
+inline int requestor_id(int cpu, int slot){
+    return cpu + slot * MAX_CPUS;
+}
+
+inline int requestor_cpu(int requestor){
+    return requestor % MAX_CPUS;
+}
+
 class Bus_if : public virtual sc_interface
 {
   public:
     // These methods needed for CPUs to send requests
     virtual bool read(int, int) = 0;
-    virtual bool write(int, int) = 0;
-    virtual int wait_for_response(int, int) = 0;
-    virtual struct request wait_for_any(int) = 0;
-    virtual bool cache_to_cache(int, int, int, int*) = 0;
+    virtual bool write(int, int, const cacheline_data&) = 0;
+    virtual int wait_for_response(int, int, cacheline_data*) = 0;
+    virtual struct request wait_for_any(int, SnoopFilter*) = 0;
+    // flush: the memory takes the transferred line too (ACT_FLUSH)
+    virtual bool cache_to_cache(int, int, int, const cacheline_data&, bool) = 0;
     virtual bool cacheline_invalidate(int, int) = 0;
+    virtual bool update(int, int, const cacheline_data&) = 0;
+    // Shared line of the bus. Snooping caches assert it for the requestor
+    // when they keep a copy of the requested line.
+    virtual void assert_shared(int, int) = 0;
+    virtual bool is_shared(int, int) = 0;
+    // Tells if the last response to the requestor came from other cache
+    virtual bool supplied_by_cache(int, int) = 0;
+    // Inhibit line. A snooping cache which supplies the requested line asserts
+    // it, so the memory doesn't answer the read as well.
+    virtual void assert_supplied(int, int) = 0;
+    virtual bool is_supplied(int, int) = 0;
     // virtual void acquire_bus_lock() = 0;
     // virtual void release_bus_lock() = 0;
 
     // These methods needed for memory module to put high priority responses on the bus and get requests
-    virtual void memory_response(int, int) = 0;
-    virtual struct request get_next_request() = 0;
+    virtual void memory_response(int, int, const cacheline_data&) = 0;
+    // Next read or write-back for the memory controller, see MemoryMap.h
+    virtual struct request get_next_request(int) = 0;
     virtual void memory_controller_wait() = 0;
+
+    virtual bus_traffic_t get_traffic() = 0;
+    // Statistics and the wires which outlive a transaction (latched responses,
+    // snoops not taken yet). No transaction may be in flight at the checkpoint.
+    virtual void checkpoint(Checkpoint&) = 0;
 };
 class Bus : public Bus_if, public sc_module
 {
@@ -57,9 +131,27 @@ class Bus : public Bus_if, public sc_module
     // sc_inout_rv<8> Port_ProcID;
 
   public:
+    bus_traffic_t traffic;
+    int transfer_cycles; // cycles to move one cacheline over the bus (data carrying transactions)
+
     SC_CTOR(Bus){
         intended.store(false);
         c2c_intended.store(false);
+        memset(&traffic, 0x0, sizeof(traffic));
+        memset(&usage, 0x0, sizeof(usage));
+        last_wait.resize(MAX_REQUESTORS + 2 * MAX_CPUS, 0);
+        wait_cycle = 0;
+        wait_count = 0;
+        transfer_cycles = 1;
+        memset(shared_line, 0x0, sizeof(shared_line));
+        memset(from_cache, 0x0, sizeof(from_cache));
+        memset(inhibit, 0x0, sizeof(inhibit));
+        memset(filters, 0x0, sizeof(filters));
+        memset(listening, 0x0, sizeof(listening));
+        memset(snoop_valid, 0x0, sizeof(snoop_valid));
+        flushing = false;
+        memset(responses, 0x0, sizeof(responses));
+        memset(&data_wires, 0x0, sizeof(data_wires));
         sensitive << Port_CLK.pos();
         // Port_ProcID(ProcID);
         // Port_BusFunc(BusFunc);
@@ -71,60 +163,75 @@ class Bus : public Bus_if, public sc_module
         dont_initialize();
     }
     virtual bool read(int proc_id, int addr){
-        if (c2c_intended.load() || intended.load() || (bus_mutex.try_lock() == false))
+        if (c2c_intended.load() || intended.load() || (bus_mutex.try_lock() == false)){
+            contend(proc_id);
             return false;   // Cache module has to wait one cycle and try again.
                             // This mutexes may be not fair, but we use them in our module.
+        }
+        uint64_t start = current_edge();
         cout << "CPU #" <<proc_id<<":" << sc_time_stamp() << ": BUS received read" << endl;
+        ++traffic.reads;
+        shared_line[proc_id] = false;
+        inhibit[proc_id] = false;
+        responses[proc_id].valid = false; // nothing older than this read is its response
 
         Port_BusAddr.write(addr);
         Port_BusFunc.write(FUNC_READ);
         Port_ProcID.write(proc_id);
+        announce(proc_id, addr, FUNC_READ);
         wait(Port_CLK.default_event());
         cout << "CPU #" <<proc_id<<":" << sc_time_stamp() << ": BUS wrote read" << endl;
         Port_BusAddr.write("ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ");
         Port_ProcID.write("ZZZZZZZZ");
         Port_BusFunc.write("ZZZZ");
+        account(BUS_TX_READ, start, 0);
         bus_mutex.unlock();
         return true;
     };
-    virtual bool write(int proc_id, int addr){
+    virtual bool write(int proc_id, int addr, const cacheline_data& data){
         
-         if (c2c_intended.load() || intended.load() || bus_mutex.try_lock() == false)
+        if (c2c_intended.load() || intended.load() || bus_mutex.try_lock() == false){
+            contend(proc_id);
             return false;
+        }
+        uint64_t start = current_edge();
         cout << "CPU #" <<proc_id<<":" << sc_time_stamp() << ": BUS received write" << endl;
+        ++traffic.writebacks;
+        responses[proc_id].valid = false; // an extra c2c of the line can't pass for the ack
+        data_wires = data;
         Port_BusAddr.write(addr);
         Port_BusFunc.write(FUNC_WRITE);
         Port_ProcID.write(proc_id);
-        wait(Port_CLK.default_event());
+        announce(proc_id, addr, FUNC_WRITE);
+        wait_edges(Port_CLK, transfer_cycles);
         Port_BusAddr.write("ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ");
         Port_ProcID.write("ZZZZZZZZ");
         Port_BusFunc.write("ZZZZ");
+        account(BUS_TX_WRITEBACK, start, CACHELINE_SIZE);
         bus_mutex.unlock();
         return true;
     }
 
-    virtual int wait_for_response(int proc_id, int addr){
-        int res = CACHEL_EXCLUSIVE;
-    lbl_wait:
+    // Returns the state the fetched cacheline gets, the coherence protocol decides
+    // it from the shared line. Other core which requested the same cacheline before
+    // us asserts the shared line as well, so two consequative requests can't both
+    // end up in an exclusive state.
+    // The response is latched for the requestor when it's put on the bus, so it
+    // can't be missed if the requestor is still on the way (ring and mesh hops).
+    // The requestor takes it at the next edge, like it would sample the wires.
+    virtual int wait_for_response(int proc_id, int addr, cacheline_data* data){
         cout << "CPU #" <<proc_id<<":" << sc_time_stamp() << ": Cache of CPU <" << proc_id << "> waits for response on bus on addr " << addr << endl;
+        response_t& r = responses[proc_id];
+        while(!r.valid || r.addr != addr)
+            wait(response_arrived[proc_id]);
         wait(Port_CLK.value_changed_event());
-        while(Port_BusAddr.read().to_int() != addr ||
-        Port_ProcID.read().to_int() != proc_id || 
-        (Port_BusFunc.read().to_int() != FUNC_RESPONSE && Port_BusFunc.read().to_int() != FUNC_REQUESTED)){
-            // cout << "CPU #" <<proc_id<<":" << sc_time_stamp() << ": Cache of CPU <" << proc_id << "> got response but not own <" << Port_ProcID.read().to_int() << ">" <<endl;
-            wait(Port_CLK.value_changed_event());
-        }
-        if(Port_BusFunc.read().to_int() == FUNC_REQUESTED){
-            // just notifying that other core also requested the cacheline
-            // so just put status to shared, but wait for real reply from DRAM controller
-            res = CACHEL_SHARED;
-            goto lbl_wait;
-        }
-        if(Port_SourceID.read().to_int() != (int)DRAM_IDENTIFIER){
-            // state of the cacheline should be shared
-            return CACHEL_SHARED;
-        }
-        return res;
+        r.valid = false;
+        if(data != NULL)
+            *data = r.data;
+        // cacheline which came from other cache is always shared
+        from_cache[proc_id] = r.from_cache;
+        bool shared = shared_line[proc_id] || from_cache[proc_id];
+        return coherence_protocol->fill_state(shared);
         // cout << "CPU #" <<proc_id<<":" << sc_time_stamp() << ": Cache of CPU <" << proc_id << "> got response for its own <" << Port_ProcID.read().to_int() << "> at address " << Port_BusAddr.read().to_int() <<endl;
 
     }
@@ -132,55 +239,94 @@ class Bus : public Bus_if, public sc_module
     // Now this function returns WRITE and READ operations to let
     // the snooping process make cache-to-cache transfers
     // and perform local cachelines states changes. 
-    virtual struct request wait_for_any(int proc_id){
+    // If the cache has a snoop filter, requests for lines it can't hold
+    // are never delivered to it, its thread isn't even woken up.
+    virtual struct request wait_for_any(int proc_id, SnoopFilter* filter){
         struct request res;
-      label1:
+        listen(proc_id, filter);
         // cout << "CPU #" <<proc_id<<":" << sc_time_stamp() << ": Snooping Cache of CPU <" << proc_id << "> waits for requests on bus" << endl;
-        wait(Port_BusFunc.value_changed_event());
-        // if it's own request or it's not writing request - then skip it
-        if((Port_BusFunc.read().to_int() != FUNC_INVALIDATE && 
-        Port_BusFunc.read().to_int() != FUNC_WRITE && Port_BusFunc.read().to_int() != FUNC_READ) 
-        || Port_ProcID.read().to_int() == proc_id) goto label1;
-
-        // else handle request correctly
+        while(!snoop(proc_id, res))
+            wait(snoop_arrived[proc_id]);
         // cout << "CPU #" <<proc_id<<":" << sc_time_stamp() << ": Snooping Cache of CPU <" << proc_id << "> got request <" << Port_ProcID.read().to_int() << ">" <<endl;
-        res.addr = Port_BusAddr.read().to_int();
-        res.func = Port_BusFunc.read().to_int();
-        res.id = Port_ProcID.read().to_int();
         return res;
     }
+
+    // The snooping cache of proc_id gets the requests of this bus from now on
+    void listen(int proc_id, SnoopFilter* filter){
+        listening[proc_id] = true;
+        filters[proc_id] = filter;
+    }
+
+    // Takes the request delivered to the snooping cache of proc_id, if there is one
+    bool snoop(int proc_id, struct request& res){
+        if(!snoop_valid[proc_id])
+            return false;
+        snoop_valid[proc_id] = false;
+        res = snooped[proc_id];
+        return true;
+    }
+
+    sc_event snoop_arrived[MAX_CPUS]; // the snooping cache has a request to handle
     
-    virtual struct request get_next_request(){
-    label1:
-        // cout << sc_time_stamp() << ": MEMORY snooping is waiting for the next request" << endl;
-        wait(Port_CLK.default_event());
-        // cout << sc_time_stamp() << ": MEMORY snooping thinks it got request" << endl;
-        if(Port_BusFunc.read().to_int() == FUNC_RESPONSE || Port_BusFunc.read().to_int() == FUNC_NOTHING)goto label1;
+    virtual struct request get_next_request(int controller){
         struct request res;
-        res.id = Port_ProcID.read().to_int();
+        // cout << sc_time_stamp() << ": MEMORY snooping is waiting for the next request" << endl;
+        do{
+            if(!config.clocked) // nothing to sample until the wires change
+                wait(Port_BusFunc.value_changed_event() | Port_BusAddr.value_changed_event() |
+                     Port_ProcID.value_changed_event());
+            wait(Port_CLK.default_event());
+            // cout << sc_time_stamp() << ": MEMORY snooping thinks it got request" << endl;
+        }while(!memory_request(controller, res));
+        return res;
+    }
+
+    // Checks the request which is on the bus right now. Returns true if the
+    // memory controller has to serve it.
+    bool memory_request(int controller, struct request& res){
+        // only reads, write-backs and flushed cache-to-cache transfers reach the memory,
+        // invalidations and updates are for caches only
+        bool flush = Port_BusFunc.read().to_int() == FUNC_RESPONSE && flushing;
+        if(Port_BusFunc.read().to_int() != FUNC_READ && Port_BusFunc.read().to_int() != FUNC_WRITE && !flush)
+            return false;
+        // the snooping caches have seen the read an edge before, so the
+        // inhibit line is already valid when the memory samples it
+        if(Port_BusFunc.read().to_int() == FUNC_READ && inhibit[Port_ProcID.read().to_int()])
+            return false;
+        if(memory_map.controller_of(Port_BusAddr.read().to_int(), requestor_cpu(Port_ProcID.read().to_int())) != controller)
+            return false;
+        // the flushed line is written by its supplier, not by the requestor
+        res.id = flush ? Port_SourceID.read().to_int() : Port_ProcID.read().to_int();
         res.addr = Port_BusAddr.read().to_int();
         res.func = Port_BusFunc.read().to_int();
-        cout << sc_time_stamp() << ": MEMORY snooping got request from <"<<res.id<<"> with func " << (res.func == 2?"WRITE" : "READ") << " at address " << res.addr << endl;
-        return res;
+        res.data = data_wires;
+        cout << sc_time_stamp() << ": MEMORY snooping got request from <"<<res.id<<"> with func " << (res.func == 2?"WRITE" : res.func == 1 ? "READ" : "FLUSH") << " at address " << res.addr << endl;
+        return true;
     }
 
-    virtual void memory_response(int proc_id, int addr){
+    virtual void memory_response(int proc_id, int addr, const cacheline_data& data){
         cout << "CPU #" <<proc_id<<":" << sc_time_stamp() << ": MEMORY MAIN SENDS result to the bus from addr " << addr << endl;
-        while(c2c_intended.load())wait(Port_CLK.default_event()); // sleep only one cycle, because of c2c communications are fast - one cycle
+        int contender = MAX_REQUESTORS + MAX_CPUS + memory_map.controller_of(addr, requestor_cpu(proc_id));
+        while(c2c_intended.load()){ contend(contender); wait(Port_CLK.default_event()); } // sleep only one cycle, because of c2c communications are fast - one cycle
         intended = true;
-        while(bus_mutex.try_lock() == false){intended = true; wait(Port_CLK.default_event());};
+        while(bus_mutex.try_lock() == false){intended = true; contend(contender); wait(Port_CLK.default_event());};
+        uint64_t start = current_edge();
+        ++traffic.responses;
+        data_wires = data;
         Port_BusAddr.write(addr);
         Port_BusFunc.write(FUNC_RESPONSE);
         Port_ProcID.write(proc_id);
         Port_SourceID.write(DRAM_IDENTIFIER);
+        latch_response(proc_id, addr, false, data);
         // cout << "CPU #" <<proc_id<<":" << sc_time_stamp() << ": MEMORY MAIN SENDS result of <" << proc_id << "> to the bus" << endl;
-        wait(Port_CLK.default_event());
+        wait_edges(Port_CLK, transfer_cycles);
         // cout << "CPU #" <<proc_id<<":" << sc_time_stamp() << ": MEMORY MAIN SENT result of <" << proc_id << "> to the bus" << endl;
 
         Port_BusAddr.write("ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ");
         Port_ProcID.write("ZZZZZZZZ");
         Port_SourceID.write("ZZZZZZZZ");
         Port_BusFunc.write("ZZZZ");
+        account(BUS_TX_RESPONSE, start, CACHELINE_SIZE);
         bus_mutex.unlock();
         intended = false;
     }
@@ -189,29 +335,31 @@ class Bus : public Bus_if, public sc_module
         wait(Port_BusFunc.default_event());
     }
 
-    virtual bool cache_to_cache(int proc_id, int source_id, int addr, int* clstate){
+    // State of the supplying cacheline is already changed by the snooping cache,
+    // the bus only transfers the data.
+    // The data is the copy of the cacheline taken when the snoop was handled.
+    virtual bool cache_to_cache(int proc_id, int source_id, int addr, const cacheline_data& data, bool flush){
         c2c_intended = true;
         cout << "CPU #" <<proc_id<<":" << sc_time_stamp() << ": CACHE TO CACHE <" << source_id << "> to the "<< proc_id << endl;
-        while(bus_mutex.try_lock() == false){ wait(Port_CLK.default_event());};
+        while(bus_mutex.try_lock() == false){ contend(MAX_REQUESTORS + source_id); wait(Port_CLK.default_event());};
+        uint64_t start = current_edge();
         // cout << "CPU #" <<proc_id<<":" << sc_time_stamp() << ": CACHE TO CACHE <" << source_id << "> to the IS LOCKED"<< proc_id << endl;        
+        ++traffic.c2c;
+        data_wires = data;
+        flushing = flush;
         Port_BusAddr.write(addr);
-        Port_BusFunc.write(*clstate == CACHEL_REQUESTED? FUNC_REQUESTED : FUNC_RESPONSE);
+        Port_BusFunc.write(FUNC_RESPONSE);
         Port_ProcID.write(proc_id);
         Port_SourceID.write(source_id); // this field identifies that response is not sent by the DRAM controller
+        latch_response(proc_id, addr, true, data);
         
-        switch(*clstate){
-            case CACHEL_MODIFIED:
-                *clstate = CACHEL_OWNED;
-                break;
-            case CACHEL_EXCLUSIVE:
-                *clstate = CACHEL_SHARED;
-        }
-        
-        wait(Port_CLK.default_event());
+        wait_edges(Port_CLK, transfer_cycles);
         Port_BusAddr.write("ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ");
         Port_ProcID.write("ZZZZZZZZ");
         Port_SourceID.write("ZZZZZZZZ");
         Port_BusFunc.write("ZZZZ");
+        account(BUS_TX_C2C, start, CACHELINE_SIZE);
+        flushing = false;
         bus_mutex.unlock();
         c2c_intended = false;
         // cout << "CPU #" <<proc_id<<":" << sc_time_stamp() << ": CACHE TO CACHE <" << source_id << "> to the "<< proc_id << " IS FINISHED " << endl;
@@ -223,20 +371,120 @@ class Bus : public Bus_if, public sc_module
         // this request shouldn't be prioritiezed. but it should be supported
         // with always checking the status of the cacheline, if it's invalid - it doesnt have permission to invalidate it
         // also we should keep in mind possible deadlocks here.
-        if (c2c_intended.load() || intended.load() || bus_mutex.try_lock() == false)
+        if (c2c_intended.load() || intended.load() || bus_mutex.try_lock() == false){
+            contend(proc_id);
             return false;
-        cout << "CPU #" <<proc_id<<":" << sc_time_stamp() << ": BUS received write" << endl;
+        }
+        uint64_t start = current_edge();
+        cout << "CPU #" <<proc_id<<":" << sc_time_stamp() << ": BUS received invalidate" << endl;
+        ++traffic.invalidates;
         Port_BusAddr.write(addr);
         Port_BusFunc.write(FUNC_INVALIDATE);
         Port_ProcID.write(proc_id);
+        announce(proc_id, addr, FUNC_INVALIDATE);
         wait(Port_CLK.default_event());
         Port_BusAddr.write("ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ");
         Port_ProcID.write("ZZZZZZZZ");
         Port_BusFunc.write("ZZZZ");
+        account(BUS_TX_INVALIDATE, start, 0);
         bus_mutex.unlock();
         return true;
     };
 
+    virtual bool update(int addr, int proc_id, const cacheline_data& data){
+        // broadcasts new value of the written word to the other copies (update based protocols).
+        // After it's done the shared line tells if somebody still has the cacheline.
+        if (c2c_intended.load() || intended.load() || bus_mutex.try_lock() == false){
+            contend(proc_id);
+            return false;
+        }
+        uint64_t start = current_edge();
+        cout << "CPU #" <<proc_id<<":" << sc_time_stamp() << ": BUS received update" << endl;
+        ++traffic.updates;
+        shared_line[proc_id] = false;
+        data_wires = data;
+        Port_BusAddr.write(addr);
+        Port_BusFunc.write(FUNC_UPDATE);
+        Port_ProcID.write(proc_id);
+        announce(proc_id, addr, FUNC_UPDATE);
+        wait(Port_CLK.default_event());
+        Port_BusAddr.write("ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ");
+        Port_ProcID.write("ZZZZZZZZ");
+        Port_BusFunc.write("ZZZZ");
+        account(BUS_TX_UPDATE, start, CACHELINE_SIZE);
+        bus_mutex.unlock();
+        return true;
+    };
+
+    virtual void assert_shared(int proc_id, int addr){
+        shared_line[proc_id] = true;
+    }
+
+    virtual bool is_shared(int proc_id, int addr){
+        return shared_line[proc_id];
+    }
+
+    virtual bool supplied_by_cache(int proc_id, int addr){
+        return from_cache[proc_id];
+    }
+
+    virtual void assert_supplied(int proc_id, int addr){
+        inhibit[proc_id] = true;
+    }
+
+    virtual bool is_supplied(int proc_id, int addr){
+        return inhibit[proc_id];
+    }
+
+    virtual bus_traffic_t get_traffic(){
+        return traffic;
+    }
+
+    virtual void checkpoint(Checkpoint& cp){
+        cp.tag("BUS");
+        if(cp.saving){
+            // a process in the middle of a transaction can't be saved
+            if(intended.load() || c2c_intended.load() || !bus_mutex.try_lock())
+                throw std::runtime_error("Error, a bus transaction is in flight at the checkpoint");
+            bus_mutex.unlock();
+        }
+        cp.io(traffic);
+        cp.io(usage);
+        cp.io(series);
+        cp.io(shared_line);
+        cp.io(from_cache);
+        cp.io(inhibit);
+        cp.io(responses);
+        cp.io(snoop_valid);
+        cp.io(snooped);
+    }
+
+    // One row of the utilization table, busy times in cycles
+    void print_usage(int segment, uint64_t cycles){
+        uint64_t busy = 0;
+        for(int t = 0; t < BUS_TX_COUNT; ++t)
+            busy += usage.busy[t];
+        printf("%d\t%f", segment, cycles ? 50.0 * busy / cycles : 0.0);
+        for(int t = 0; t < BUS_TX_COUNT; ++t)
+            printf("\t%.1f", usage.busy[t] / 2.0);
+        printf("\t%lu\t%f\t%f\t%lu\n", (unsigned long)usage.bytes, cycles ? (double)usage.bytes / cycles : 0.0,
+               cycles ? (double)usage.waiting / cycles : 0.0, (unsigned long)usage.max_waiting);
+    }
+
+    void print_usage_csv(FILE* f, int segment){
+        for(size_t i = 0; i < series.size(); ++i){
+            const bus_usage_t& u = series[i];
+            fprintf(f, "%d,%lu", segment, (unsigned long)(i * config.bus_interval));
+            for(int t = 0; t < BUS_TX_COUNT; ++t)
+                fprintf(f, ",%.1f", u.busy[t] / 2.0);
+            fprintf(f, ",%lu,%f,%lu\n", (unsigned long)u.bytes, (double)u.waiting / config.bus_interval,
+                    (unsigned long)u.max_waiting);
+        }
+    }
+
+    bus_usage_t usage;                 // the whole run
+    std::vector<bus_usage_t> series;   // intervals of config.bus_interval cycles, only with bus-csv
+
     // virtual void acquire_bus_lock(){
     //     while(!bus_mutex.try_lock())wait(Port_CLK.default_event());
     // };
@@ -246,9 +494,106 @@ class Bus : public Bus_if, public sc_module
     // };
 
    private:
+    struct response_t {
+        bool valid;
+        int addr;
+        bool from_cache;
+        cacheline_data data;
+    };
+
+    static uint64_t current_edge(){
+        return cycle_offset * 2 + sc_time_stamp().value() / (sc_time(CLOCK_PERIOD_NS, SC_NS).value() / 2);
+    }
+
+    bus_usage_t& interval(uint64_t cycle){
+        size_t i = cycle / config.bus_interval;
+        if(i >= series.size()){
+            bus_usage_t zero;
+            memset(&zero, 0x0, sizeof(zero));
+            series.resize(i + 1, zero);
+        }
+        return series[i];
+    }
+
+    // The transaction which started at the edge releases the bus now
+    void account(BusTransaction type, uint64_t start, int bytes){
+        uint64_t edges = current_edge() - start;
+        usage.busy[type] += edges;
+        usage.bytes += bytes;
+        if(!config.bus_csv.empty()){
+            bus_usage_t& u = interval(current_cycle());
+            u.busy[type] += edges;
+            u.bytes += bytes;
+        }
+    }
+
+    // Somebody lost the arbitration. Caches are their requestors, c2c senders
+    // and memory controllers come after them.
+    void contend(int who){
+        uint64_t cycle = current_cycle();
+        if(last_wait[who] == cycle + 1)
+            return; // already counted in this cycle
+        last_wait[who] = cycle + 1;
+        if(cycle != wait_cycle){
+            wait_cycle = cycle;
+            wait_count = 0;
+        }
+        ++wait_count;
+        ++usage.waiting;
+        usage.max_waiting = std::max(usage.max_waiting, wait_count);
+        if(!config.bus_csv.empty()){
+            bus_usage_t& u = interval(cycle);
+            ++u.waiting;
+            u.max_waiting = std::max(u.max_waiting, wait_count);
+        }
+    }
+
+    // The request goes on the bus. Every other snooping cache gets it unless
+    // its filter says that the cache can't have the line, only those are woken up.
+    // They run in the next delta cycle, like when they waited for the wires.
+    void announce(int proc_id, int addr, int func){
+        int requestor = requestor_cpu(proc_id);
+        for(int c = 0; c < MAX_CPUS; ++c){
+            if(!listening[c] || c == requestor)
+                continue;
+            if(filters[c] != NULL && !filters[c]->pass(addr))
+                continue;
+            struct request& r = snooped[c];
+            r.id = proc_id;
+            r.addr = addr;
+            r.func = func;
+            r.data = data_wires;
+            snoop_valid[c] = true;
+            snoop_arrived[c].notify(SC_ZERO_TIME);
+        }
+    }
+
+    void latch_response(int proc_id, int addr, bool from_cache, const cacheline_data& data){
+        response_t& r = responses[proc_id];
+        r.valid = true;
+        r.addr = addr;
+        r.from_cache = from_cache;
+        r.data = data;
+        response_arrived[proc_id].notify(SC_ZERO_TIME);
+    }
+
     std::mutex bus_mutex; // this mutex acts as arbiter
     std::atomic_bool intended; // for high priority memory responses
     std::atomic_bool c2c_intended; // for the highest priority cache-to-cache responses
+    bool shared_line[MAX_REQUESTORS]; // one wire per requestor, reset when it puts new request on the bus
+    bool from_cache[MAX_REQUESTORS];  // source of the last response to the requestor
+    bool flushing;                    // the cache-to-cache transfer on the wires goes to the memory as well
+    bool inhibit[MAX_REQUESTORS];     // a cache supplies the read of the requestor, reset with the shared line
+    SnoopFilter* filters[MAX_CPUS];   // of the snooping caches, NULL if a cache has none
+    bool listening[MAX_CPUS];         // the snooping cache waits for requests of this bus
+    bool snoop_valid[MAX_CPUS];       // snooped holds a request the cache hasn't taken yet
+    struct request snooped[MAX_CPUS]; // request delivered to the snooping cache
+    response_t responses[MAX_REQUESTORS];       // latest response for every requestor
+    sc_event response_arrived[MAX_REQUESTORS];
+    cacheline_data data_wires;  // valid while the transaction which drives them holds the bus
+    std::vector<uint64_t> last_wait; // cycle + 1 when the contender was last counted
+    uint64_t wait_cycle;             // cycle of wait_count
+    uint64_t wait_count;             // contenders counted in that cycle
 };
 
 #endif
\ No newline at end of file
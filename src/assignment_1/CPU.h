@@ -3,6 +3,14 @@
 
 #include "utils.h"
 #include "Memory.h"
+#include "Checker.h"
+#include "Clock.h"
+#include "Cache.h"
+#include "TraceSource.h"
+#include "Checkpoint.h"
+#include "Config.h"
+#include <deque>
+#include "tlm_utils/tlm_quantumkeeper.h"
 
 SC_MODULE(CPU)
 {
@@ -12,30 +20,163 @@ public:
     sc_in<Memory::RetCode>   Port_MemDone;
     sc_out<Memory::Function> Port_MemFunc;
     sc_out<int>                Port_MemAddr;
-    // sc_inout_rv<32>            Port_MemData;
+    sc_inout_rv<32>            Port_MemData; // used only in the functional mode
+    // Direct access to the cache for the loosely timed mode
+    sc_port<Cache_if, 1, SC_ZERO_OR_MORE_BOUND> Port_Cache;
     int id;
+    unsigned long lt_accesses; // served by the cache without going through the ports
+    unsigned long lt_syncs;    // times the CPU had to synchronize with the rest of the system
 
-    CPU(sc_module_name name_, int id_): sc_module(name_), id(id_){
-        SC_THREAD(execute);
+    // Statistics of the out-of-order core
+    struct ooo_stats_t {
+        uint64_t retired;       // trace entries including NOPs
+        uint64_t cycles;        // until the last entry retired
+        uint64_t rob_full;      // cycles the dispatch waited for the full reorder window
+        uint64_t lsq_full;      // cycles ready accesses waited for a free LSQ slot
+        uint64_t busy_cycles;   // cycles with at least one access in flight
+        uint64_t access_cycles; // sum of the accesses in flight over all cycles
+        int max_in_flight;
+    } ooo;
+
+    CPU(sc_module_name name_, int id_)
+    : sc_module(name_), id(id_), lt_accesses(0), lt_syncs(0), trace_position(0), entries(0), seq(0),
+      lt_warmup(config.lt_entries()), rob_size(config.rob), lsq_size(config.lsq), issue_width(config.issue_width){
+        if(rob_size > 0){
+            SC_THREAD(execute_ooo);
+        } else {
+            SC_THREAD(execute);
+        }
         sensitive << Port_CLK.pos();
         dont_initialize();
+        memset(&ooo, 0x0, sizeof(ooo));
+        in_flight = 0;
+        last_change = 0;
+        tlm_utils::tlm_quantumkeeper::set_global_quantum(sc_time(LT_QUANTUM * CLOCK_PERIOD_NS, SC_NS));
+        m_qk.reset();
     }
     SC_HAS_PROCESS(CPU);
+
+    // CPUs which stopped at the checkpoint cycle
+    static unsigned int& parked_cpus(){
+        static unsigned int n = 0;
+        return n;
+    }
+
+    // A parked CPU has no access in flight, so the trace position is all
+    // of its state. The restored CPU skips the entries it already ran.
+    void checkpoint(Checkpoint& cp){
+        cp.tag("CPU");
+        cp.expect(id, "CPU order");
+        cp.io(trace_position);
+        cp.io(seq);
+        cp.io(lt_accesses);
+        cp.io(lt_syncs);
+        cp.io(ooo);
+        if(cp.saving)
+            return;
+        TraceFile::Entry e;
+        for(uint64_t i = 0; i < trace_position; ++i)
+            if(!trace_source->next(id, e))
+                throw std::runtime_error("Error, trace is shorter than in the checkpoint");
+        entries = trace_position;
+    }
+
 private:
+    uint64_t trace_position; // entries taken from the trace and executed
+    uint64_t entries;        // iterations, for the loosely timed warmup
+    unsigned int seq;        // of the values written in the functional mode
+    uint64_t lt_warmup;      // entries run loosely timed before the cycle accurate model
+    int rob_size;            // sizes of the out-of-order core, rob_size is 0 for the in-order CPU
+    int lsq_size;
+    int issue_width;
+
+    // Loosely timed mode: the CPU runs ahead of the simulation kernel in its local
+    // time as long as the cache serves accesses without the bus. Every access which
+    // needs the bus synchronizes first and goes the cycle accurate way, so bus
+    // transactions stay ordered. Snoops from other CPUs are seen at most one
+    // quantum late, that's the price for not switching threads on every cycle.
+    tlm_utils::tlm_quantumkeeper m_qk;
+
+    static unsigned int& finished_cpus(){
+        static unsigned int n = 0;
+        return n;
+    }
+
+    // cycle of the CPU including the time it ran ahead
+    uint64_t now(){
+        return current_cycle() + (uint64_t)(m_qk.get_local_time() / sc_time(CLOCK_PERIOD_NS, SC_NS));
+    }
+
+    void advance(int cycles){
+        m_qk.inc(sc_time(cycles * CLOCK_PERIOD_NS, SC_NS));
+        if(m_qk.need_sync()){
+            ++lt_syncs;
+            m_qk.sync();
+        }
+    }
+
+    // Returns true if the access was done by the cache directly
+    bool lt_access(Memory::Function f, int addr, int& data){
+        if(Port_Cache.size() == 0)
+            return false;
+        int value = 0;
+        if(f == Memory::FUNC_WRITE && functional_mode)
+            value = (id << 24) | ((seq + 1) & 0xffffff);
+        uint64_t start = now();
+        int cycles;
+        if(!Port_Cache->lt_access(f, addr, value, cycles))
+            return false;
+        ++lt_accesses;
+        if(f == Memory::FUNC_WRITE){
+            ++cycles; // the data is on the wires one more cycle
+            if(functional_mode){
+                data = value;
+                ++seq;
+                golden_memory->begin_write(id, addr, data);
+                golden_memory->end_write(id, addr, data, start + cycles);
+            }
+        } else if(functional_mode){
+            data = value;
+            golden_memory->check_read(id, addr, data, start, start + cycles);
+        }
+        advance(cycles);
+        return true;
+    }
+
     void execute()
     {
         TraceFile::Entry    tr_data;
         Memory::Function  f;
+        int               data = 0;
+        uint64_t          start = 0;
+        bool              pending = false; // tr_data was read ahead while skipping NOPs
 
-        // Loop until end of tracefile
-        while(!tracefile_ptr->eof())
+        // Loop until end of tracefile. Clocked timing keeps every CPU running NOPs
+        // until all traces end, otherwise every CPU stops after its own trace.
+        while(config.clocked ? !trace_source->eof() : (pending || !trace_source->finished(id)))
         {
+            if(config.checkpoint_at != 0 && now() >= config.checkpoint_at)
+            {
+                // the last access is done and the next one isn't started, a quiet point
+                m_qk.sync();
+                if(pending)
+                    --trace_position; // it will be read again after the restore
+                cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CPU parks for the checkpoint" << endl;
+                if(++parked_cpus() + finished_cpus() == num_cpus)
+                    sc_stop();
+                return;
+            }
+
             // Get the next action for the processor in the trace
-            if(!tracefile_ptr->next(id, tr_data))
+            if(pending)
+                pending = false;
+            else if(!trace_source->next(id, tr_data))
             {
                 cerr << "Error reading trace for CPU" << endl;
                 break;
             }
+            else
+                ++trace_position;
 
             switch(tr_data.type)
             {
@@ -55,8 +196,32 @@ private:
                     exit(0);
             }
 
+            if(entries++ < lt_warmup)
+            {
+                // loosely timed: NOPs and hits only move the local time
+                if(tr_data.type == TraceFile::ENTRY_TYPE_NOP || lt_access(f, tr_data.addr, data))
+                {
+                    advance(1);
+                    continue;
+                }
+                ++lt_syncs;
+                m_qk.sync();
+            }
+            else if(entries == lt_warmup + 1 && lt_warmup != 0)
+            {
+                m_qk.sync();
+                cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CPU switches to the cycle accurate mode" << endl;
+            }
+
             if(tr_data.type != TraceFile::ENTRY_TYPE_NOP)
             {
+                start = current_cycle();
+                if(functional_mode && f == Memory::FUNC_WRITE){
+                    // every written value is unique, so the checker knows which write a read observed
+                    data = (id << 24) | (++seq & 0xffffff);
+                    Port_MemData.write(data);
+                    golden_memory->begin_write(id, tr_data.addr, data);
+                }
                 Port_MemAddr.write(tr_data.addr);
                 Port_MemFunc.write(f);
 
@@ -64,9 +229,9 @@ private:
                 {
                     cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CPU sends write" << endl;
 
-                    // Port_MemData.write(data);
                     wait(Port_CLK.default_event());
-                    // Port_MemData.write("ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ");
+                    if(functional_mode)
+                        Port_MemData.write("ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ");
                 }
                 else
                 {
@@ -77,8 +242,30 @@ private:
 
                 if (f == Memory::FUNC_READ)
                 {
-                    cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CPU reads: " << endl;
+                    if(functional_mode){
+                        data = Port_MemData.read().to_int();
+                        golden_memory->check_read(id, tr_data.addr, data, start, current_cycle());
+                    }
+                    cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CPU reads: " << data << endl;
                 }
+                else if(functional_mode)
+                    golden_memory->end_write(id, tr_data.addr, data, current_cycle());
+            }
+            else if(!config.clocked)
+            {
+                // a run of NOPs is slept through at once, the entry after it is kept for the next iteration
+                uint64_t nops = 1;
+                while(!trace_source->finished(id) && trace_source->next(id, tr_data)){
+                    ++trace_position;
+                    if(tr_data.type != TraceFile::ENTRY_TYPE_NOP){
+                        pending = true;
+                        break;
+                    }
+                    ++nops;
+                }
+                cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CPU executes " << nops << " NOPs" << endl;
+                wait_edges(Port_CLK, nops);
+                continue;
             }
             else
             {
@@ -89,6 +276,203 @@ private:
         }
 
         // Finished the Tracefile, now stop the simulation
+        m_qk.sync();
+        if(!config.clocked && ++finished_cpus() + parked_cpus() < num_cpus)
+            return; // the last CPU to finish stops it
+        sc_stop();
+    }
+
+    // Out-of-order core. Trace entries are dispatched in order into the reorder
+    // window, memory accesses issue out of order as soon as they have an LSQ slot
+    // and retire in order, issue_width of each per cycle, the core steps on the
+    // rising edges of the clock. NOPs stand for the
+    // independent instructions between accesses and are done at dispatch.
+    // The trace has no register dependencies, the only ones we know are through
+    // the memory: an access waits for all older accesses to the same cacheline,
+    // so the CPU sees its own writes in order and one cacheline has at most one
+    // access of the CPU in the cache. Stores are not buffered to retirement,
+    // they go to the cache when they are ready like the loads.
+    struct rob_entry_t {
+        TraceFile::Entry entry;
+        bool issued;
+        bool done;
+        int value;      // of the write or the read in the functional mode
+        uint64_t start; // cycle of the issue
+    };
+    std::deque<rob_entry_t> rob; // references to the entries stay valid at both ends
+    rob_entry_t* lsq[MAX_MSHRS];  // access of every slot, NULL if the slot is free
+    sc_event lsq_start[MAX_MSHRS];
+    sc_event access_done;
+    int in_flight;
+    uint64_t last_change;
+    bool rob_stalled;
+    bool lsq_stalled;
+
+    // Integrates the number of accesses in flight over time before it changes
+    void account(){
+        uint64_t now = current_cycle();
+        ooo.access_cycles += (now - last_change) * in_flight;
+        if(in_flight > 0)
+            ooo.busy_cycles += now - last_change;
+        last_change = now;
+    }
+
+    void lsq_slot(int slot){
+        while(true){
+            wait(lsq_start[slot]);
+            rob_entry_t* e = lsq[slot];
+            bool write = e->entry.type == TraceFile::ENTRY_TYPE_WRITE;
+            Port_Cache->access(write ? Memory::FUNC_WRITE : Memory::FUNC_READ, e->entry.addr, e->value, slot);
+            if(functional_mode){
+                if(write)
+                    golden_memory->end_write(id, e->entry.addr, e->value, current_cycle());
+                else
+                    golden_memory->check_read(id, e->entry.addr, e->value, e->start, current_cycle());
+            }
+            account();
+            --in_flight;
+            e->done = true;
+            lsq[slot] = NULL;
+            access_done.notify(SC_ZERO_TIME);
+        }
+    }
+
+    // Issues ready accesses, returns true if some ready one was left for the next cycle
+    bool issue(){
+        int issued = 0;
+        lsq_stalled = false;
+        for(unsigned int i = 0; i < rob.size(); ++i){
+            rob_entry_t& e = rob[i];
+            if(e.issued || e.done) continue;
+            bool ready = true;
+            for(unsigned int j = 0; j < i && ready; ++j)
+                if(!rob[j].done && rob[j].entry.type != TraceFile::ENTRY_TYPE_NOP &&
+                   (rob[j].entry.addr & ~0b11111) == (e.entry.addr & ~0b11111))
+                    ready = false;
+            if(!ready) continue;
+            if(issued == issue_width)
+                return true;
+            int slot = 0;
+            while(slot < lsq_size && lsq[slot] != NULL) ++slot;
+            if(slot == lsq_size){
+                lsq_stalled = true;
+                return false; // a slot gets free only when some access is done
+            }
+            e.issued = true;
+            e.start = current_cycle();
+            if(functional_mode && e.entry.type == TraceFile::ENTRY_TYPE_WRITE){
+                // every written value is unique, so the checker knows which write a read observed
+                e.value = (id << 24) | (++seq & 0xffffff);
+                golden_memory->begin_write(id, e.entry.addr, e.value);
+            }
+            cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CPU issues "
+                 << (e.entry.type == TraceFile::ENTRY_TYPE_WRITE ? "write" : "read") << " [" << e.entry.addr << "]" << endl;
+            account();
+            ooo.max_in_flight = std::max(ooo.max_in_flight, ++in_flight);
+            lsq[slot] = &e;
+            lsq_start[slot].notify(SC_ZERO_TIME);
+            ++issued;
+        }
+        return false;
+    }
+
+    void execute_ooo()
+    {
+        for(int i = 0; i < lsq_size; ++i){
+            lsq[i] = NULL;
+            sc_spawn(sc_bind(&CPU::lsq_slot, this, i));
+        }
+        last_change = current_cycle();
+        uint64_t begin = current_cycle();
+        TraceFile::Entry next;
+        bool pending = false; // next was read ahead while looking for NOPs
+        bool parking = false;
+        uint64_t last = begin;
+        rob_stalled = lsq_stalled = false;
+        while(pending || !trace_source->finished(id) || !rob.empty())
+        {
+            // the stalls of the last step lasted until now
+            uint64_t cycle = current_cycle();
+            if(rob_stalled) ooo.rob_full += cycle - last;
+            if(lsq_stalled) ooo.lsq_full += cycle - last;
+            last = cycle;
+            rob_stalled = false;
+
+            if(config.checkpoint_at != 0 && current_cycle() >= config.checkpoint_at)
+                parking = true; // no new entries, the window drains
+
+            // retire
+            for(int n = 0; n < issue_width && !rob.empty() && rob.front().done; ++n){
+                rob.pop_front();
+                ++ooo.retired;
+            }
+            if(parking && rob.empty())
+                break;
+
+            // dispatch
+            bool more = pending || !trace_source->finished(id);
+            for(int n = 0; n < issue_width && more && !parking; ++n){
+                if((int)rob.size() == rob_size){
+                    rob_stalled = true;
+                    break;
+                }
+                if(pending)
+                    pending = false;
+                else if(!trace_source->next(id, next)){
+                    cerr << "Error reading trace for CPU" << endl;
+                    more = false;
+                    break;
+                }
+                else
+                    ++trace_position;
+                if(next.type != TraceFile::ENTRY_TYPE_NOP && next.type != TraceFile::ENTRY_TYPE_READ &&
+                   next.type != TraceFile::ENTRY_TYPE_WRITE){
+                    cerr << "Error, got invalid data from Trace" << endl;
+                    exit(0);
+                }
+                if(next.type == TraceFile::ENTRY_TYPE_NOP && rob.empty() && !config.clocked){
+                    // nothing in flight, a run of NOPs is slept through at once
+                    uint64_t nops = 1;
+                    while(!trace_source->finished(id) && trace_source->next(id, next)){
+                        ++trace_position;
+                        if(next.type != TraceFile::ENTRY_TYPE_NOP){
+                            pending = true;
+                            break;
+                        }
+                        ++nops;
+                    }
+                    cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CPU executes " << nops << " NOPs" << endl;
+                    ooo.retired += nops;
+                    // the step at the end of the loop is the last cycle of them
+                    wait_cycles(Port_CLK, (nops + issue_width - 1) / issue_width - 1);
+                    break;
+                }
+                rob_entry_t e = {next, false, next.type == TraceFile::ENTRY_TYPE_NOP, 0, 0};
+                rob.push_back(e);
+                more = pending || !trace_source->finished(id);
+            }
+
+            bool ready_left = issue();
+            bool progress = ready_left || (!rob.empty() && rob.front().done) ||
+                            (!parking && (int)rob.size() < rob_size && (pending || !trace_source->finished(id)));
+            if(!progress && !rob.empty() && !config.clocked)
+                wait(access_done); // everything waits for the memory
+            else
+                wait(Port_CLK.posedge_event());
+        }
+        ooo.cycles += current_cycle() - begin; // restored runs continue the count
+        account();
+
+        if(parking){
+            if(pending)
+                --trace_position; // it will be read again after the restore
+            cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CPU parks for the checkpoint" << endl;
+            if(++parked_cpus() + finished_cpus() == num_cpus)
+                sc_stop();
+            return;
+        }
+        if(++finished_cpus() + parked_cpus() < num_cpus)
+            return; // the last CPU to finish stops it
         sc_stop();
     }
 };
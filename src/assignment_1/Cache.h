@@ -3,26 +3,43 @@
 
 #include "utils.h"
 #include <math.h>
+#include <deque>
 #include "Bus.h"
-#include <sched.h>
+#include "Memory.h"
+#include "Protocol.h"
+#include "Checker.h"
+#include "Clock.h"
+#include "LatencyHistogram.h"
+#include "Config.h"
 
 extern std::atomic<unsigned int> _main_memory_access_rate;
-extern std::atomic<unsigned int > _time_for_bus_acquisition;
+
+// Outcomes of processor accesses, every one has its own latency histogram
+enum AccessOutcome {
+    OUTCOME_HIT,
+    OUTCOME_MISS_MEMORY,  // line came from the memory
+    OUTCOME_MISS_C2C,     // line came from other cache
+    OUTCOME_UPGRADE,      // hit which needed invalidate/update on the bus
+    OUTCOME_COUNT,
+};
+static const char* const OUTCOME_NAMES[OUTCOME_COUNT] = {"Hit", "MissMem", "MissC2C", "Upgrade"};
 
 
-class SingleCache : public sc_module {
+// Direct access of the CPU to its cache for the loosely timed mode and the out-of-order core
+class Cache_if : public virtual sc_interface
+{
+  public:
+    // Does the access right away and returns true with its latency in cycles if the
+    // cache can do it without the bus, otherwise returns false and changes nothing.
+    // value is the word to write or the word which was read.
+    virtual bool lt_access(Memory::Function, int, int&, int&) = 0;
+    // Cycle accurate access in the thread of the caller, which waits until it's
+    // done. Every slot (below MAX_MSHRS) can have one access in flight.
+    virtual void access(Memory::Function, int, int&, int) = 0;
+};
+
+class SingleCache : public sc_module, public Cache_if {
     public:    
-    struct cache_record_t{
-        int counter;    // need to implement LRU logic
-        int state;    // MOESI, but lets keep 4 bits for this field
-        int tag: 24;    // we assumte that we have 32bit system, so we have 4KB pages.
-                        // Since cacheline size is 32-bytes- we need only 5[0-4] bits for inner offset,
-                        // we could use bits [11-5] to encode index, since we need only 3 bits,
-                        // we will use only [7-5] bits to encode index of address.
-                        // (those bits will be the same for virtual and physical addresses)
-                        // the rest will go for the tag.
-        int data[8];    // no comments...
-    };
     int id;
 
     // From CPU
@@ -30,236 +47,400 @@ class SingleCache : public sc_module {
     sc_in<Memory::Function> Port_Func;
     sc_in<int>      Port_Addr;
     sc_out<Memory::RetCode> Port_Done;
-    // sc_inout_rv<32> Port_Data;
+    sc_inout_rv<32> Port_Data; // carries the values only in the functional mode
 
     // To Bus module
     sc_port<Bus_if> bus{"cache_to_bus"};
     // sc_inout_rv<32> Port_Data_MEM; // -- not being used anymore for simple modeling
 
+    SnoopFilter* snoop_filter; // NULL if snoops are not filtered
+    LatencyHistogram bus_wait;                // cycles from asking for the bus until the grant
+    LatencyHistogram latency[OUTCOME_COUNT];  // cycles from the request of the CPU until done
+
     SC_CTOR(SingleCache)
+    : cachelines(config.cache_sets, config.cache_ways), c2c_active(0)
     {
         SC_THREAD(snooping);
         SC_THREAD(execute);
         sensitive << Port_CLK.pos();
         dont_initialize();
-        cachelines = new struct cache_record_t[CACHE_SIZE];
-        memset(cachelines, 0x0, sizeof(struct cache_record_t) * CACHE_SIZE);
+        snoop_filter = config.snoop_filter ? new SnoopFilter() : NULL;
     }
 
     ~SingleCache()
     {
-        delete[] cachelines;
+        delete snoop_filter;
+    }
+
+    // Tags, states, LRU counters and data of all lines with the filter which
+    // tracks them, and the latency statistics
+    void checkpoint(Checkpoint& cp){
+        cp.tag("CACHE");
+        cp.expect(id, "cache order");
+        cp.expect(config.cache_sets, "cache sets");
+        cp.expect(config.cache_ways, "cache ways");
+        cp.expect(snoop_filter != NULL, "snoop filter setting");
+        cachelines.checkpoint(cp);
+        if(snoop_filter != NULL)
+            cp.io(*snoop_filter);
+        cp.io(bus_wait);
+        for(int o = 0; o < OUTCOME_COUNT; ++o)
+            cp.io(latency[o]);
+        // queued transfers are sent by the workers after the restore, one
+        // which is already on its way can't be saved
+        if(cp.saving && c2c_active != 0)
+            throw std::runtime_error("Error, a cache-to-cache transfer is in flight at the checkpoint");
+        cp.io(c2c_queue);
     }
 
 private:
-    struct cache_record_t* cachelines;
+    CacheArray cachelines;
+
+    // Snoop filter bookkeeping. We remember which address every line put into
+    // the filter, so exactly the same address leaves it when the line is
+    // invalidated or replaced.
+    void filter_track(int i, int addr){
+        if(snoop_filter == NULL) return;
+        filter_untrack(i);
+        cachelines[i].sf_addr = addr;
+        cachelines[i].sf_tracked = true;
+        snoop_filter->insert(addr);
+    }
+
+    void filter_untrack(int i){
+        if(snoop_filter == NULL || !cachelines[i].sf_tracked) return;
+        snoop_filter->remove(cachelines[i].sf_addr);
+        cachelines[i].sf_tracked = false;
+    }
+
+    // Only hits which the protocol allows without a bus transaction are done here,
+    // the rest goes through the ports and the cycle accurate path.
+    virtual bool lt_access(Memory::Function f, int addr, int& value, int& cycles){
+        int event = (f == Memory::FUNC_WRITE) ? EV_PR_WRITE : EV_PR_READ;
+        int rindex = cachelines.find(addr);
+        if(rindex < 0 || cachelines[rindex].state == CACHEL_REQUESTED)
+            return false;
+        const ProtocolTransition& t = coherence_protocol->on(cachelines[rindex].state, event);
+        if(t.actions & (ACT_READ | ACT_INVALIDATE | ACT_UPDATE))
+            return false;
+
+        int victim;
+        cachelines.lookup(addr, victim); // LRU bookkeeping is the same as for the cycle accurate access
+        cachelines[rindex].counter = MAX_COUNTER;
+        cachelines[rindex].state = t.next;
+        if(f == Memory::FUNC_WRITE){
+            cachelines[rindex].data.words[word_of(addr)] = value;
+            stats_writehit(id);
+        } else {
+            value = cachelines[rindex].data.words[word_of(addr)];
+            stats_readhit(id);
+        }
+        cycles = 1; // one cycle of cache hit, like the clocked path
+        latency[OUTCOME_HIT].record(cycles);
+        return true;
+    }
+
+    // Cache-to-cache transfers wait here for one of the workers. The data is
+    // copied when the snoop hits, the line could be changed before the transfer is done.
+    struct c2c_transfer_t {
+        int requestor;
+        int addr;
+        cacheline_data data;
+        bool flush;         // the memory takes the line as well
+    };
+    std::deque<c2c_transfer_t> c2c_queue;
+    sc_event c2c_queued;
+    int c2c_active;     // transfers taken by the workers and not done yet
 
-    int addr_to_index(int addr){ // This function is just for the mappingaddr to cache set
-        return (((addr & CACHEINDEX_MASK) >> CACHEINDEX_SHIFT) * CACHE_SET_SIZE) % CACHE_SIZE;
+    // Workers are spawned once, spawning a process for every transfer is expensive
+    void c2c_worker(){
+        while(true){
+            while(c2c_queue.empty())
+                wait(c2c_queued);
+            c2c_transfer_t t = c2c_queue.front();
+            c2c_queue.pop_front();
+            ++c2c_active;
+            bus->cache_to_cache(t.requestor, id, t.addr, t.data, t.flush);
+            --c2c_active;
+        }
     }
 
     void snooping(){
-        // this thread actually performs snooping on interconnection bus and invalids cacheline if write was sent
+        for(int i = 0; i < config.c2c_workers; ++i)
+            sc_spawn(sc_bind(&SingleCache::c2c_worker, this));
+        // this thread actually performs snooping on interconnection bus and changes
+        // states of local cachelines as the coherence protocol tells it
         while(true){
-            struct request req = bus->wait_for_any(id);
-            int index = addr_to_index(req.addr);
-            int rindex = -1;
-            for(int i = index; i < index + CACHE_SET_SIZE; ++i){
-                if((cachelines[i].state != CACHEL_INVALID) && 
-                (cachelines[i].tag == ((req.addr & CACHETAG_MASK) >> CACHETAG_SHIFT))){
-                    // cacheline is presented
-                    rindex = i;
-                } 
-            }
+            struct request req = bus->wait_for_any(id, snoop_filter);
+            int rindex = cachelines.find(req.addr); // is cacheline presented?
             if(rindex > -1){
-
-                if(req.func == Memory::FUNC_WRITE ||
-                    req.func == Memory::FUNC_INVALIDATE ){
-                        // Invalidate cacheline.
-                        cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CACHE received invalidated for " << req.addr << endl;
-                        cachelines[rindex].state = CACHEL_INVALID; // INVALID
-                } else if(req.func == Memory::FUNC_READ){
+                int event;
+                switch(req.func){
+                    case Memory::FUNC_READ:       event = EV_BUS_READ; break;
+                    case Memory::FUNC_WRITE:      event = EV_BUS_WRITEBACK; break;
+                    case Memory::FUNC_INVALIDATE: event = EV_BUS_INVALIDATE; break;
+                    default:                      event = EV_BUS_UPDATE; break;
+                }
+                const ProtocolTransition& t = coherence_protocol->on(cachelines[rindex].state, event);
+                if(t.actions & ACT_SHARED){
+                    bus->assert_shared(req.id, req.addr);
+                    // other core requested the same cacheline before we got it,
+                    // so we are not the only owner anymore
                     if(cachelines[rindex].state == CACHEL_REQUESTED)
-                        cachelines[rindex].state = CACHEL_SHARED;
-                    // we have to send response to the requestor ...    
-                    sc_spawn(sc_bind(&Bus::cache_to_cache, dynamic_cast<Bus*>(bus.get_interface()), req.id, id, req.addr, &cachelines[rindex].state)); //  this thread has to be issued in parallel
+                        cachelines[rindex].shared = true;
+                }
+                if(t.actions & ACT_STALE)
+                    cachelines[rindex].stale = true;
+                if(t.actions & ACT_FLUSH)
+                    _main_memory_access_rate.fetch_add(1, std::memory_order_relaxed); // memory snarfs the transfer, see c2c_worker
+                if(cachelines[rindex].state != t.next)
+                    cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CACHE snoop changes state of " << req.addr << " to " << t.next << endl;
+                cachelines[rindex].state = t.next;
+                if(t.next == CACHEL_INVALID)
+                    filter_untrack(rindex);
+                if(req.func == Memory::FUNC_UPDATE)
+                    cachelines[rindex].data = req.data; // Dragon: the writer broadcasts the whole line
+                // several sharers may answer the read (MOESI), only the first one supplies it
+                if((t.actions & ACT_SUPPLY) && !bus->is_supplied(req.id, req.addr)){
+                    // we have to send response to the requestor, one of the workers does it in parallel.
+                    // The memory must not answer the read too, its response would be left latched
+                    bus->assert_supplied(req.id, req.addr);
+                    c2c_transfer_t transfer = {req.id, req.addr, cachelines[rindex].data, (t.actions & ACT_FLUSH) != 0};
+                    c2c_queue.push_back(transfer);
+                    c2c_queued.notify();
                 }
             }
         }
     }
 
+    // Performs bus actions the protocol requires for the processor access to the valid
+    // cacheline and moves it to the next state. Returns false if the cacheline was
+    // invalidated by somebody else while we were waiting for the bus.
+    // value is the word a write stores into the line, req is the requestor on the bus,
+    // upgraded is set if the access had to go to the bus.
+    bool access_line(int i, int addr, int event, int value, int req, bool& upgraded){
+        const ProtocolTransition* t = &coherence_protocol->on(cachelines[i].state, event);
+        if(t->actions & (ACT_INVALIDATE | ACT_UPDATE)){
+            // If current thread coudln't acquire the bus lock - it has to recheck that
+            // cacheline status is in corect state(NOT INVALID), only then it can try to acquire bus lock again,
+            // otherwise - have to request new copy of cacheline from the memory. The problem of deadlock is presented here.
+            // that's why we need to acquire lock during writing(invalidate-then-write), otherwise two processes could
+            // invalidate each other forever.
+            uint64_t requested = current_cycle();
+            upgraded = true;
+            while(!((t->actions & ACT_INVALIDATE) ? bus->cacheline_invalidate(addr, req) : broadcast(i, addr, value, req))){
+                wait(Port_CLK.default_event()); // wait for a one cycle
+                wait(Port_CLK.negedge_event()); // need to wait half of the cycle to let cacheline be invalidated.
+                if(cachelines[i].state == CACHEL_INVALID)
+                    return false;
+                // state could be changed by snooping, so protocol has to be asked again
+                t = &coherence_protocol->on(cachelines[i].state, event);
+                if(!(t->actions & (ACT_INVALIDATE | ACT_UPDATE)))
+                    break;
+            }
+            bus_wait.record(current_cycle() - requested);
+            if((t->actions & ACT_UPDATE) && !bus->is_shared(req, addr)){
+                // nobody else has the cacheline anymore
+                cachelines[i].state = coherence_protocol->update_unshared;
+                cachelines[i].data.words[word_of(addr)] = value;
+                return true;
+            }
+        } else if(event == EV_PR_READ){
+            wait(Port_CLK.negedge_event());
+            if(cachelines[i].state == CACHEL_INVALID) {
+            // this is needed because of in one cycle of simulation hit/miss
+            // somebody could invalidate the cacheline :(
+                return false;
+            }
+            t = &coherence_protocol->on(cachelines[i].state, event);
+        }
+        cachelines[i].state = t->next;
+        if(event == EV_PR_WRITE)
+            cachelines[i].data.words[word_of(addr)] = value;
+        return true;
+    }
+
+    void record_miss(int addr, uint64_t start, int req){
+        int outcome = bus->supplied_by_cache(req, addr & ~0b11111) ? OUTCOME_MISS_C2C : OUTCOME_MISS_MEMORY;
+        latency[outcome].record(current_cycle() - start);
+    }
+
+    static int word_of(int addr){
+        return (addr & (CACHELINE_SIZE - 1)) >> 2;
+    }
+
+    // Dragon update carries the line with the new word already in it
+    bool broadcast(int i, int addr, int value, int req){
+        cacheline_data line = cachelines[i].data;
+        line.words[word_of(addr)] = value;
+        return bus->update(addr, req, line);
+    }
+
+    // Hands the read word over to the CPU, the data wires are released after the cycle
+    void finish_read(int i, int addr){
+        if(functional_mode)
+            Port_Data.write(cachelines[i].data.words[word_of(addr)]);
+        Port_Done.write(Memory::RET_READ_DONE);
+        wait(Port_CLK.default_event());
+        if(functional_mode)
+            Port_Data.write("ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ");
+    }
+
+    // Writes the dirty victim back, unless a snoop has done it for us (the
+    // line isn't dirty anymore) while we were waiting for the bus
+    void write_back(int i, int req){
+        cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CACHE WRITING-BACK CACHELINE" << endl;
+        int wbaddr = cachelines.addr_of(i);
+        _main_memory_access_rate.fetch_add(1, std::memory_order_relaxed);
+        uint64_t requested = current_cycle();
+        while(!bus->write(req, wbaddr, cachelines[i].data)){
+            wait(Port_CLK.default_event());
+            if(!(coherence_protocol->on(cachelines[i].state, EV_EVICT).actions & ACT_WRITEBACK))
+                return; // no need to make writeback - it's already done modification by somebody else there
+        } // trying to send request to the bus on every cycle
+        bus_wait.record(current_cycle() - requested);
+        bus->wait_for_response(req, wbaddr, NULL); // waiting when request will be responded by memory through the bus 
+    }
+
+    // Fetches the line of the address into the victim i and does the write of
+    // a write miss. Returns false if it has to be fetched again: somebody wrote
+    // it after we requested it, or took it away before the write got the bus.
+    bool refill(int i, Memory::Function f, int addr, int value, int req, bool& upgraded){
+        cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CACHE sends read" << endl;
+        _main_memory_access_rate.fetch_add(1, std::memory_order_relaxed);
+        // the line is REQUESTED from now on and snoops for the new address have to find it
+        filter_track(i, addr & ~0b11111); // old line (if any) leaves the filter here
+        cachelines[i].state = CACHEL_REQUESTED;
+        cachelines[i].tag = cachelines.tag_of(addr);
+        cachelines[i].counter = MAX_COUNTER;
+        cachelines[i].shared = false;
+        cachelines[i].stale = false;
+        uint64_t requested = current_cycle();
+        while(!bus->read(req, addr & ~0b11111))wait(Port_CLK.default_event());
+        bus_wait.record(current_cycle() - requested);
+        int fill = bus->wait_for_response(req, addr & ~0b11111, &cachelines[i].data);
+        if(cachelines[i].stale){
+            // somebody wrote the cacheline after we requested it
+            cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CACHE got outdated cacheline, requesting again" << endl;
+            return false;
+        }
+        // if somebody requested this cacheline as well, then shared. Not exclusive.
+        cachelines[i].state = cachelines[i].shared ? coherence_protocol->fill_state(true) : fill;
+        cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CACHE reads cacheline" << endl;
+        if(f == Memory::FUNC_WRITE){
+            // protocol decides how the fetched cacheline becomes modified
+            if(!access_line(i, addr, EV_PR_WRITE, value, req, upgraded)){
+                wait(Port_CLK.default_event());
+                return false;
+            }
+            cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CACHE performs write-through" << endl;
+        }
+        return true;
+    }
 
     void execute()
     {
-        timespec time1, time2;
         while (true)
         {
             wait(Port_Func.value_changed_event());
 
             Memory::Function f = Port_Func.read();
             int addr   = Port_Addr.read();
-            if (f == Memory::FUNC_WRITE)
-            {
-                cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CACHE received write" << endl;
-            }
-            else
-            {
-                cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CACHE received read" << endl;
-            }
+            int value  = (functional_mode && f == Memory::FUNC_WRITE) ? Port_Data.read().to_int() : 0;
+            int i = serve(0, f, addr, value, current_cycle());
+            if(f == Memory::FUNC_WRITE){
+                Port_Done.write(Memory::RET_WRITE_DONE);
+                wait(Port_CLK.default_event());// simulating one cycle of write to the cache...
+            } else
+                finish_read(i, addr); // simulating one cycle of reading from the cache...
+        }
+    }
 
-            
-            // First lets check if data is cached...
-            int index;
-            int rindex;
-            int min_id;
-            int min_val;
-            int wbaddr;
-
-            index = addr_to_index(addr); //  We have 8 entries per set
-        check_the_cachelinestat:
-            rindex = -1;
-            min_id = index;
-            min_val = MAX_COUNTER + 2;
-            for(int i = index; i < index + CACHE_SET_SIZE; ++i){
-                if((cachelines[i].state != CACHEL_INVALID) && (cachelines[i].tag == ((addr & CACHETAG_MASK) >> CACHETAG_SHIFT))){
-                    rindex = i;
-                } else {
-                    // saving the minimum counter in advance
-                    if((cachelines[i].state == CACHEL_INVALID)){
-                        min_id = i;
-                        min_val = -1; // to be sure...
-                    } else if(cachelines[i].counter < min_val) {
-                        min_val = cachelines[i].counter; 
-                        min_id = i;
-                    }
-                    cachelines[i].counter = std::max(0x0, cachelines[i].counter - 1);
-                }
-            }
+    // The out-of-order CPU calls it from its LSQ threads, one per slot. The word
+    // goes to the CPU one cycle after the access, like over the ports.
+    virtual void access(Memory::Function f, int addr, int& value, int slot){
+        int i = serve(slot, f, addr, value, current_cycle());
+        if(f == Memory::FUNC_READ)
+            value = cachelines[i].data.words[word_of(addr)];
+        wait(Port_CLK.default_event());
+    }
+
+    // Does the access of the CPU through the bus requestor of the slot and returns
+    // the line which holds the word now. Several slots could be in here at once:
+    // an access which finds its line busy with another one (the line is being
+    // filled or replaced) waits for it, that's the merge of a secondary miss.
+    int serve(int slot, Memory::Function f, int addr, int value, uint64_t start)
+    {
+        int req = requestor_id(id, slot);
+        bool upgraded = false;
+        int event = (f == Memory::FUNC_WRITE) ? EV_PR_WRITE : EV_PR_READ;
+        if (f == Memory::FUNC_WRITE)
+        {
+            cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CACHE received write" << endl;
+        }
+        else
+        {
+            cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CACHE received read" << endl;
+        }
+
+        
+        // First lets check if data is cached...
+        int rindex;
+        int min_id;
+        // the lookup is done again if the line was busy or got lost while we were waiting
+        while(true){
+            rindex = cachelines.lookup(addr, min_id);
             wait(Port_CLK.default_event()); // simulating one cycle of cache hit/miss...
-            if(rindex > -1){
-                // Data is cached
-                cachelines[rindex].counter = MAX_COUNTER;
-                if(f == Memory::FUNC_WRITE){   
-                    // first have to check that cache is not invalidated by somebody else
-                    // I use goto here, but it's reasonable(ask kernel hackers)
-                    // If current thread coudln't acquire the bus lock - it has to recheck that
-                    // cacheline status is in corect state(NOT INVALID), only then it can try to acquire bus lock again,
-                    // otherwise - have to request new copy of cacheline from the memory. The problem of deadlock is presented here.
-                    // that's why we need to acquire lock during writing(invalidate-then-write), otherwise two processes could
-                    // invalidate each other forever.
-
-                    // here we need only send invalidate message, that's it, then our cache will be in MODIFIED state
-                    while(!bus->cacheline_invalidate(addr, id)){
-                        wait(Port_CLK.default_event()); // wait for a one cycle
-                        wait(Port_CLK.negedge_event()); // need to wait half of the cycle to let cacheline be invalidated.
-
-                        if(cachelines[rindex].state == CACHEL_INVALID) {
-                        // this is the most ugly piece of code in my solution
-                        // but there is no way to avoid it, sorry :)
-                            wait(Port_CLK.default_event());
-                            goto check_the_cachelinestat;
-                        }
-                    };
-                    // cacheline invalidated signal is sent.
-                    // now lets change state of cacheline to modified.
-                    cachelines[rindex].state = CACHEL_MODIFIED;
-
-                    cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CACHE WRITE HIT " << endl;
-                    stats_writehit(id);
-                    // data = Port_Data.read().to_int();
-                    // cachelines[rindex].data[addr & 0x1f / 4] = data;
-                    // cachelines[rindex].state |= CACHEL_DIRTY;
-                    Port_Done.write(Memory::RET_WRITE_DONE);
-                    wait(Port_CLK.default_event());// simulating one cycle of write to the cache...
-                } else {
-                    wait(Port_CLK.negedge_event());
-                    if(cachelines[rindex].state == CACHEL_INVALID) {
-                    // this is needed because of in one cycle of simulation hit/miss
-                    // somebody could invalidate the cacheline :(
-                        wait(Port_CLK.default_event());
-                        goto check_the_cachelinestat;
-                    }
-                    cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CACHE READ HIT " << endl;                    
-                    stats_readhit(id);
-                    // Port_Data.write((addr < MEM_SIZE) ? cachelines[rindex].data[addr & 0x1f / 4] : 0);
-                    Port_Done.write(Memory::RET_READ_DONE);
-                    wait(Port_CLK.default_event());// simulating one cycle of reading from the cache...
-                }
-                // Port_Data.write("ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ");
-            } else{
-                // Data is not cached, need to request from the memory
-                if(f == Memory::FUNC_WRITE)
-                    cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CACHE WRITE MISS " << endl;
-                else
-                    cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CACHE READ MISS " << endl;
-                // but first have to write-back one cacheline if there is no empty one and cacheline is dirty
-                if(cachelines[min_id].state == CACHEL_MODIFIED || cachelines[min_id].state == CACHEL_OWNED){
-                    cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CACHE WRITING-BACK CACHELINE" << endl;
-                    wbaddr = cachelines[min_id].tag << CACHETAG_SHIFT | (addr & ~CACHETAG_MASK & ~0b11111);
-                    for(int ii = 0; ii < 20; ++ii)sched_yield();                    
-                    _main_memory_access_rate.fetch_add(1, std::memory_order_relaxed);                    
-                    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time1);
-                    while(!bus->write(id, wbaddr)){
-                        // wait(Port_CLK.default_event()); 
-                        wait(Port_CLK.default_event());
-                        if(!(cachelines[min_id].state == CACHEL_MODIFIED || cachelines[min_id].state == CACHEL_OWNED))
-                            goto _post_writeback; // no need to make writeback - it's already done modification by somebody else there
-                    } // trying to send request to the bus on every cycle
-                    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time2);
-                    unsigned int result = (time2.tv_sec - time1.tv_sec) * 1e6 + (time2.tv_nsec - time1.tv_nsec) / 1e3;
-                    _time_for_bus_acquisition.fetch_add(result, std::memory_order_relaxed);
-                    bus->wait_for_response(id, wbaddr); // waiting when request will be responded by memory through the bus 
-                }
-            _post_writeback:
-
-                // then do actual reading from memory to cache
-                cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CACHE sends read" << endl;
-                for(int ii = 0; ii < 20; ++ii)sched_yield();
-                _main_memory_access_rate.fetch_add(1, std::memory_order_relaxed);
-                cachelines[min_id].state = CACHEL_REQUESTED;
-                clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time1);
-                while(!bus->read(id, addr & ~0b11111))wait(Port_CLK.default_event());
-                clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time2);
-                unsigned int result = (time2.tv_sec - time1.tv_sec) * 1e6 + (time2.tv_nsec - time1.tv_nsec) / 1e3;
-                _time_for_bus_acquisition.fetch_add(result, std::memory_order_relaxed);
-                // if somebody requested this cacheline, then shared. Not exclusive.
-                cachelines[min_id].state = cachelines[min_id].state == CACHEL_REQUESTED? bus->wait_for_response(id, addr & ~0b11111) : cachelines[min_id].state;
-                cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CACHE reads cacheline" << endl;
-                cachelines[min_id].tag = (addr & CACHETAG_MASK) >> CACHETAG_SHIFT;
-                cachelines[min_id].counter = MAX_COUNTER;
-                // Write-back phase is finished
-                if (f == Memory::FUNC_WRITE)
-                {
-                    // invalidating the cacheline and changing the status to modified
-                    if(cachelines[min_id].state == CACHEL_SHARED)
-                        while(!bus->cacheline_invalidate(addr, id)){
-                            wait(Port_CLK.default_event()); // wait for a one cycle
-                            wait(Port_CLK.negedge_event()); // need to wait half of the cycle to let cacheline be invalidated.
-                            if(cachelines[min_id].state == CACHEL_INVALID) {
-                            // this is the most ugly piece of code in my solution
-                            // but there is no way to avoid it, sorry :)
-                                wait(Port_CLK.default_event());
-                                goto _post_writeback;
-                            }
-                        };
-
-                    stats_writemiss(id);
-                    // cachelines[min_id].data[addr & 0b11111] = Port_Data.read().to_int();
-                    cachelines[min_id].state = CACHEL_MODIFIED;
-                    cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CACHE performs write-through" << endl;                   
-                    Port_Done.write(Memory::RET_WRITE_DONE);
-                    wait(Port_CLK.default_event());
-                } else {
-                    stats_readmiss(id);
-                    // Port_Data.write(cachelines[min_id].data[addr & 0b11111]);
-                    // Port_Data.write(1234);
-                    Port_Done.write(Memory::RET_READ_DONE);
+            if(cachelines[rindex > -1 ? rindex : min_id].busy){
+                // other access of this CPU has the line in flight, the lookup is
+                // done again when it's finished (not every cycle, that would age the set)
+                while(cachelines[rindex > -1 ? rindex : min_id].busy)
                     wait(Port_CLK.default_event());
-                    // Port_Data.write("ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ");
-                }
+                continue;
+            }
+            if(rindex < 0)
+                break;
+            // Data is cached
+            cachelines[rindex].counter = MAX_COUNTER;
+            cachelines[rindex].busy = true;
+            bool done = access_line(rindex, addr, event, value, req, upgraded);
+            cachelines[rindex].busy = false;
+            if(!done){
+                // cacheline was lost while we were waiting, this is a miss now
+                wait(Port_CLK.default_event());
+                continue;
             }
+            if(f == Memory::FUNC_WRITE){   
+                cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CACHE WRITE HIT " << endl;
+                stats_writehit(id);
+            } else {
+                cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CACHE READ HIT " << endl;                    
+                stats_readhit(id);
+            }
+            latency[upgraded ? OUTCOME_UPGRADE : OUTCOME_HIT].record(current_cycle() - start);
+            return rindex;
         }
+
+        // Data is not cached, need to request from the memory
+        if(f == Memory::FUNC_WRITE)
+            cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CACHE WRITE MISS " << endl;
+        else
+            cout << "CPU #" <<id<<":" << sc_time_stamp() << ": CACHE READ MISS " << endl;
+        cachelines[min_id].busy = true; // nobody else takes it as the victim
+        // but first have to write-back one cacheline if the protocol says that victim is dirty
+        if(coherence_protocol->on(cachelines[min_id].state, EV_EVICT).actions & ACT_WRITEBACK)
+            write_back(min_id, req);
+        // then do actual reading from memory to cache, again if the line was outdated or lost
+        while(!refill(min_id, f, addr, value, req, upgraded))
+            ;
+        if(f == Memory::FUNC_WRITE)
+            stats_writemiss(id);
+        else
+            stats_readmiss(id);
+        record_miss(addr, start, req);
+        cachelines[min_id].busy = false;
+        return min_id;
     }   
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,119 @@
+#ifndef CACHEARRAY_MOD
+#define CACHEARRAY_MOD
+
+#include <string.h>
+#include <algorithm>
+#include "utils.h"
+#include "Checkpoint.h"
+
+// Contents of one cacheline, moved over the data wires of the bus
+struct cacheline_data {
+    int words[CACHELINE_WORDS];
+};
+
+struct cache_record_t{
+    int counter;    // need to implement LRU logic
+    int state;    // MOESI, but lets keep 4 bits for this field
+    int tag;        // address bits above the index, the index takes log2(sets) bits
+                    // above the 5 bits of offset in the 32-byte cacheline
+    cacheline_data data; // no comments...
+    int sf_addr;    // address of the line accounted in the snoop filter
+    bool sf_tracked;
+    bool shared;    // REQUESTED line was requested by somebody else as well
+    bool stale;     // REQUESTED line was written by somebody else
+    bool busy;      // an access of the own CPU works on the line (hit or fill)
+};
+
+// Set associative array of cachelines with the LRU counters. It knows nothing
+// about SystemC, so the SystemC cache and the standalone engine share it.
+// Record only needs counter, state and tag, so the engine which doesn't move
+// data can keep a whole set in one host cacheline.
+template <class Record>
+class BasicCacheArray {
+    public:
+    // sets has to be a power of two
+    BasicCacheArray(int sets_ = CACHE_SETS, int ways_ = CACHE_SET_SIZE)
+    : sets(sets_), ways(ways_), tag_shift(CACHEINDEX_SHIFT)
+    {
+        while((1 << (tag_shift - CACHEINDEX_SHIFT)) < sets) ++tag_shift;
+        lines = new Record[size()];
+        memset(lines, 0x0, sizeof(Record) * size());
+    }
+
+    ~BasicCacheArray(){
+        delete[] lines;
+    }
+
+    Record& operator[](int i){ return lines[i]; }
+    const Record& operator[](int i) const{ return lines[i]; }
+
+    int size() const{ return sets * ways; }
+
+    int set_of(int addr) const{ // first line of the set the address maps to
+        return (((unsigned int)addr >> CACHEINDEX_SHIFT) & (sets - 1)) * ways;
+    }
+
+    int tag_of(int addr) const{
+        return (unsigned int)addr >> tag_shift;
+    }
+
+    // Address of the cacheline held by line i, for write-backs
+    int addr_of(int i) const{
+        return ((unsigned int)lines[i].tag << tag_shift) | ((i / ways) << CACHEINDEX_SHIFT);
+    }
+
+    // Index of the valid line of the address or -1, nothing is changed
+    int find(int addr) const{
+        int index = set_of(addr);
+        int tag = tag_of(addr);
+        int rindex = -1;
+        for(int i = index; i < index + ways; ++i)
+            if((lines[i].state != CACHEL_INVALID) && (lines[i].tag == tag))
+                rindex = i;
+        return rindex;
+    }
+
+    // Finds the line of the address in its set and ages the other lines of the set.
+    // min_id gets the victim for the case of a miss: an invalid line or the least recently used one.
+    int lookup(int addr, int& min_id){
+        int index = set_of(addr);
+        int tag = tag_of(addr);
+        int rindex = -1;
+        int min_val = MAX_COUNTER + 2;
+        int victim = index; // kept local, min_id could alias the lines for the compiler
+        for(int i = index; i < index + ways; ++i){
+            if((lines[i].state != CACHEL_INVALID) && (lines[i].tag == tag)){
+                rindex = i;
+            } else {
+                // saving the minimum counter in advance
+                if((lines[i].state == CACHEL_INVALID)){
+                    victim = i;
+                    min_val = -1; // to be sure...
+                } else if(lines[i].counter < min_val) {
+                    min_val = lines[i].counter;
+                    victim = i;
+                }
+                lines[i].counter = std::max(0x0, lines[i].counter - 1);
+            }
+        }
+        min_id = victim;
+        return rindex;
+    }
+
+    void checkpoint(Checkpoint& cp){
+        cp.io_bytes(lines, sizeof(Record) * size());
+    }
+
+    private:
+    Record* lines;
+    int sets;
+    int ways;
+    int tag_shift;
+
+    BasicCacheArray(const BasicCacheArray&);
+    BasicCacheArray& operator=(const BasicCacheArray&);
+};
+
+typedef BasicCacheArray<cache_record_t> CacheArray;
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef CHECKER_MOD
+#define CHECKER_MOD
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include <unordered_map>
+#include "utils.h"
+#include "Checkpoint.h"
+
+// Golden memory for the functional mode. CPUs report every write when they
+// issue it and when it's done, and every read value when it's done.
+// A write may take effect at any moment between its issue and completion, a
+// read may take effect at any moment between its issue and completion, so a
+// read value is correct if it was the value of the word at some moment of the
+// read, or if it is the value of a write which is in flight. Any other value
+// means that the protocol broke coherence of the word. Words are checked one
+// by one, the order of accesses to different words isn't checked, so this is
+// not a check of sequential consistency.
+class CoherenceChecker {
+    public:
+    CoherenceChecker() : reads(0), writes(0), errors(0) {}
+
+    void begin_write(int cpu, uint32_t addr, int value){
+        word_t& w = words[addr >> 2];
+        pending_t p = {cpu, value};
+        w.pending.push_back(p);
+    }
+
+    void end_write(int cpu, uint32_t addr, int value, uint64_t cycle){
+        word_t& w = words[addr >> 2];
+        for(unsigned int i = 0; i < w.pending.size(); ++i)
+            if(w.pending[i].cpu == cpu){
+                w.pending.erase(w.pending.begin() + i);
+                break;
+            }
+        version_t v = {value, cycle};
+        w.history.push_back(v);
+        if(w.history.size() > HISTORY)
+            w.history.erase(w.history.begin());
+        ++writes;
+    }
+
+    // start is the cycle when the read was issued, cycle when it's done
+    bool check_read(int cpu, uint32_t addr, int value, uint64_t start, uint64_t cycle){
+        ++reads;
+        std::unordered_map<uint32_t, word_t>::iterator it = words.find(addr >> 2);
+        if(it == words.end()){
+            // never written, memory is zero initialized
+            if(value == 0) return true;
+            return report(cpu, addr, value, 0, cycle);
+        }
+        word_t& w = it->second;
+        for(unsigned int i = 0; i < w.pending.size(); ++i)
+            if(w.pending[i].value == value) return true;
+        // versions from the one current at the start of the read up to now
+        int expected = 0;
+        for(int i = (int)w.history.size() - 1; i >= 0; --i){
+            if(w.history[i].value == value) return true;
+            expected = w.history[i].value;
+            if(w.history[i].cycle <= start) return report(cpu, addr, value, expected, cycle);
+        }
+        // all history is newer than the read start, older versions are lost
+        if(w.history.size() < HISTORY && value == 0) return true;
+        return report(cpu, addr, value, expected, cycle);
+    }
+
+    // The history has to come along, reads after the restore are checked against it
+    void checkpoint(Checkpoint& cp){
+        cp.tag("CHECKER");
+        cp.io(reads);
+        cp.io(writes);
+        cp.io(errors);
+        uint64_t count = words.size();
+        cp.io(count);
+        if(cp.saving){
+            for(std::unordered_map<uint32_t, word_t>::iterator it = words.begin(); it != words.end(); ++it){
+                uint32_t word = it->first;
+                cp.io(word);
+                cp.io(it->second.pending);
+                cp.io(it->second.history);
+            }
+            return;
+        }
+        words.clear();
+        for(uint64_t i = 0; i < count; ++i){
+            uint32_t word;
+            cp.io(word);
+            word_t& w = words[word];
+            cp.io(w.pending);
+            cp.io(w.history);
+        }
+    }
+
+    void print(){
+        printf("Checker: %lu reads and %lu writes checked, %lu errors\n", reads, writes, errors);
+    }
+
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long errors;
+
+    private:
+    static const unsigned int HISTORY = 16;
+    static const unsigned long MAX_REPORTS = 20;
+
+    struct pending_t { int cpu; int value; };
+    struct version_t { int value; uint64_t cycle; };
+    struct word_t {
+        std::vector<pending_t> pending;
+        std::vector<version_t> history;
+    };
+    std::unordered_map<uint32_t, word_t> words;
+
+    bool report(int cpu, uint32_t addr, int value, int expected, uint64_t cycle){
+        if(errors++ < MAX_REPORTS)
+            printf("Checker: CPU #%d read %d from %u at cycle %lu, expected %d\n",
+                   cpu, value, addr, (unsigned long)cycle, expected);
+        return false;
+    }
+};
+
+// In the functional mode caches and memory carry real data and every read is
+// checked against the golden memory, otherwise golden_memory is NULL
+extern bool functional_mode;
+extern CoherenceChecker* golden_memory;
+
+#endif
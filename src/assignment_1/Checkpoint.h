@@ -0,0 +1,134 @@
+#ifndef CHECKPOINT_MOD
+#define CHECKPOINT_MOD
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <deque>
+#include <queue>
+#include <stdexcept>
+
+// Binary checkpoint file of the whole model. Saving and restoring go through
+// the same io() calls, so every module has one checkpoint() method which
+// lists its state once and can't get the order different in both directions.
+// Every module starts with a tag, a file from another build or with another
+// configuration is refused instead of silently restoring garbage.
+//
+// Only plain structs go through io() as raw bytes, containers are written
+// as a count and their elements.
+class Checkpoint {
+    public:
+    Checkpoint(const char* filename, bool saving_)
+    : saving(saving_), name(filename)
+    {
+        f = fopen(filename, saving ? "wb" : "rb");
+        if(f == NULL)
+            throw std::runtime_error(std::string("Error, unable to open checkpoint ") + filename);
+        tag("PSACKPT");
+        uint32_t version = VERSION;
+        io(version);
+        if(version != VERSION)
+            fail("unsupported version");
+    }
+
+    ~Checkpoint(){
+        fclose(f);
+    }
+
+    bool saving;
+
+    void io_bytes(void* data, size_t size){
+        size_t n = saving ? fwrite(data, 1, size, f) : fread(data, 1, size, f);
+        if(n != size)
+            fail(saving ? "write failed" : "file is truncated");
+    }
+
+    template <class T>
+    void io(T& value){
+        io_bytes(&value, sizeof(T));
+    }
+
+    // Values which have to be the same when the checkpoint is restored
+    template <class T>
+    void expect(T value, const char* what){
+        T saved = value;
+        io(saved);
+        if(saved != value)
+            fail(std::string("it was taken with other ") + what);
+    }
+
+    void expect(const char* value, const char* what){
+        char saved[32];
+        memset(saved, 0x0, sizeof(saved));
+        strncpy(saved, value, sizeof(saved) - 1);
+        io(saved);
+        if(strncmp(saved, value, sizeof(saved) - 1) != 0)
+            fail(std::string("it was taken with other ") + what + " (" + saved + ")");
+    }
+
+    void tag(const char* t){
+        char saved[8];
+        memset(saved, 0x0, sizeof(saved));
+        strncpy(saved, t, sizeof(saved));
+        io(saved);
+        if(strncmp(saved, t, sizeof(saved)) != 0)
+            fail(std::string("expected ") + t + " section");
+    }
+
+    template <class T>
+    void io(std::vector<T>& v){
+        uint64_t n = v.size();
+        io(n);
+        v.resize(n);
+        if(n) io_bytes(&v[0], n * sizeof(T));
+    }
+
+    template <class T>
+    void io(std::list<T>& l){
+        uint64_t n = l.size();
+        io(n);
+        if(saving){
+            for(typename std::list<T>::iterator it = l.begin(); it != l.end(); ++it)
+                io(*it);
+            return;
+        }
+        l.clear();
+        for(uint64_t i = 0; i < n; ++i){
+            T value;
+            io(value);
+            l.push_back(value);
+        }
+    }
+
+    template <class T>
+    void io(std::deque<T>& d){
+        std::list<T> l(d.begin(), d.end());
+        io(l);
+        d.assign(l.begin(), l.end());
+    }
+
+    template <class T>
+    void io(std::queue<T>& q){
+        std::list<T> l;
+        for(; !q.empty(); q.pop())
+            l.push_back(q.front());
+        io(l);
+        for(typename std::list<T>::iterator it = l.begin(); it != l.end(); ++it)
+            q.push(*it);
+    }
+
+    private:
+    static const uint32_t VERSION = 5;
+
+    FILE* f;
+    std::string name;
+
+    void fail(const std::string& why){
+        throw std::runtime_error("Error, checkpoint " + name + ": " + why);
+    }
+};
+
+#endif
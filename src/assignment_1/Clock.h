@@ -0,0 +1,59 @@
+#ifndef CLOCK_MOD
+#define CLOCK_MOD
+
+#include <systemc.h>
+#include <stdint.h>
+#include "utils.h"
+#include "Config.h"
+
+// Cycles simulated before the checkpoint the run was restored from, 0 otherwise
+extern uint64_t cycle_offset;
+
+// Simulated time expressed in cycles of the system clock
+inline uint64_t current_cycle(){
+    return cycle_offset + sc_time_stamp().value() / sc_time(CLOCK_PERIOD_NS, SC_NS).value();
+}
+
+// Waits for n changes of the clock, the same as n times wait(clk.default_event()).
+// Instead of waking up on every edge the process sleeps until the middle of the
+// half-period before the last edge and then waits for the edge itself, so it
+// resumes in the same delta cycle as processes which wait edge by edge and the
+// order of bus arbitration doesn't change.
+inline void wait_edges(sc_in<bool>& clk, uint64_t n){
+    if(config.clocked || n <= 1){
+        for(uint64_t i = 0; i < n; ++i)
+            wait(clk.default_event());
+        return;
+    }
+    uint64_t half = sc_time(CLOCK_PERIOD_NS, SC_NS).value() / 2;
+    uint64_t now = sc_time_stamp().value();
+    uint64_t edge = now / half; // the last edge at or before now
+    // the clock is high after even edges, if it isn't yet the edge of this
+    // very moment hasn't happened and counts as the first one
+    if(now % half == 0 && clk.read() != (edge % 2 == 0))
+        --edge;
+    uint64_t target = (edge + n) * half;
+    wait(sc_time::from_value(target - half / 2 - now));
+    wait(clk.default_event());
+}
+
+// Waits for n rising edges of the clock, the same as n times wait(clk.posedge_event()).
+// It sleeps the same way as wait_edges.
+inline void wait_cycles(sc_in<bool>& clk, uint64_t n){
+    if(config.clocked || n <= 1){
+        for(uint64_t i = 0; i < n; ++i)
+            wait(clk.posedge_event());
+        return;
+    }
+    uint64_t period = sc_time(CLOCK_PERIOD_NS, SC_NS).value();
+    uint64_t now = sc_time_stamp().value();
+    uint64_t cycle = now / period; // the last rising edge at or before now
+    // if the clock is still low the rising edge of this very moment hasn't happened
+    if(now % period == 0 && !clk.read())
+        --cycle;
+    uint64_t target = (cycle + n) * period;
+    wait(sc_time::from_value(target - period / 4 - now));
+    wait(clk.posedge_event());
+}
+
+#endif
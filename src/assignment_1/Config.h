@@ -0,0 +1,267 @@
+#ifndef CONFIG_MOD
+#define CONFIG_MOD
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include "utils.h"
+
+// Settings of one run, so experiments don't need a rebuild. They come from a
+// configuration file (--config=FILE) with lines like
+//   cache-sets = 256    # everything after '#' is a comment
+// and from options with the same names (--cache-sets=256), options win over
+// the file wherever they are on the command line. The defaults are the
+// constants of utils.h. sc_main fills the config before any module is built,
+// the modules read it in their constructors.
+struct Config {
+    // workload and system
+    std::string trace;
+    std::string synthetic;      // workload which replaces the trace, see SyntheticSource.h
+    int cpus;                   // 0 is one CPU per processor of the trace, a trace needs its own count
+    std::string protocol;
+    std::string topology;       // bus, multibus[:N], ring[:N] or mesh[:N]
+    bool functional;
+    bool prefetch;
+    bool clocked;               // every process wakes on every clock edge, the reference for the event driven timing
+
+    // caches
+    int cache_sets;
+    int cache_ways;
+    bool snoop_filter;
+    int c2c_workers;            // cache-to-cache transfers one cache does at once
+
+    // interconnect
+    int link_latency;
+    int link_bytes;
+
+    // memory controllers and the DRAM of every one of them
+    int memory_controllers;
+    std::string memory_interleave; // line, page or xor
+    int numa_nodes;                // 0 is no NUMA, otherwise one memory controller per node
+    std::string numa_placement;    // first-touch or interleave (pages)
+    int numa_link_latency;         // cycles of one way between nodes
+    int numa_link_bytes;           // bandwidth of the link of a node
+    int dram_channels;
+    int dram_banks;
+    int dram_row_size;
+    bool dram_open_page;
+    int dram_trcd;
+    int dram_tcas;
+    int dram_trp;
+    int dram_tburst;
+    int dram_write_queue;
+    int dram_write_high;
+    int dram_write_low;
+
+    // CPU timing
+    bool lt;                    // the whole run is loosely timed
+    uint64_t lt_warmup;         // entries per CPU before the timed part
+    int rob;                    // out-of-order window, 0 is the in-order CPU
+    int lsq;
+    int issue_width;
+
+    // output and checkpoints
+    std::string latency_csv;
+    std::string bus_csv;        // time series of the bus occupancy
+    uint64_t bus_interval;      // cycles of one row of it
+    std::string checkpoint;
+    uint64_t checkpoint_at;
+    std::string restore;
+
+    Config()
+    : cpus(0), protocol("MOESI"), topology("bus"), functional(false), prefetch(TRACE_PREFETCH),
+      clocked(CLOCKED_TIMING),
+      cache_sets(CACHE_SETS), cache_ways(CACHE_SET_SIZE), snoop_filter(SNOOP_FILTER_ENABLED),
+      c2c_workers(C2C_WORKERS), link_latency(LINK_LATENCY), link_bytes(LINK_BYTES_PER_CYCLE),
+      memory_controllers(MEMORY_CONTROLLERS), memory_interleave("line"),
+      numa_nodes(0), numa_placement("first-touch"), numa_link_latency(NUMA_LINK_LATENCY),
+      numa_link_bytes(NUMA_LINK_BYTES_PER_CYCLE),
+      dram_channels(DRAM_CHANNELS), dram_banks(DRAM_BANKS), dram_row_size(DRAM_ROW_SIZE),
+      dram_open_page(DRAM_OPEN_PAGE), dram_trcd(DRAM_tRCD), dram_tcas(DRAM_tCAS), dram_trp(DRAM_tRP),
+      dram_tburst(DRAM_tBURST), dram_write_queue(DRAM_WRITE_QUEUE), dram_write_high(DRAM_WRITE_HIGH),
+      dram_write_low(DRAM_WRITE_LOW), lt(false), lt_warmup(0), rob(0), lsq(OOO_LSQ_SIZE),
+      issue_width(OOO_ISSUE_WIDTH), bus_interval(BUS_STATS_INTERVAL), checkpoint_at(0)
+    {}
+
+    // Entries every CPU runs loosely timed
+    uint64_t lt_entries() const{
+        return lt ? UINT64_MAX : lt_warmup;
+    }
+
+    // Sets one key, false if there is no such key
+    bool set(const std::string& key, const std::string& value){
+        std::vector<entry_t> e = entries();
+        for(unsigned int i = 0; i < e.size(); ++i)
+            if(key == e[i].name){
+                parse(e[i], value);
+                return true;
+            }
+        return false;
+    }
+
+    void load(const char* filename){
+        FILE* f = fopen(filename, "r");
+        if(f == NULL)
+            throw std::runtime_error(std::string("Error, unable to open configuration ") + filename);
+        char buffer[1024];
+        int line = 0;
+        while(fgets(buffer, sizeof(buffer), f) != NULL){
+            ++line;
+            std::string s(buffer);
+            s = trim(s.substr(0, s.find('#')));
+            if(s.empty()) continue;
+            size_t eq = s.find('=');
+            if(eq == std::string::npos || !set(trim(s.substr(0, eq)), trim(s.substr(eq + 1)))){
+                fclose(f);
+                throw std::runtime_error(std::string("Error, bad line ") + std::to_string(line) + " of " +
+                                         filename + ": " + s);
+            }
+        }
+        fclose(f);
+    }
+
+    // Checks the settings which don't depend on each other's meaning
+    void validate() const{
+        if(cpus < 0 || cpus > MAX_CPUS)
+            throw std::runtime_error("Error, too many CPUs");
+        if(cache_sets < 1 || (cache_sets & (cache_sets - 1)) != 0 || cache_ways < 1)
+            throw std::runtime_error("Error, cache needs a power of two sets and at least one way");
+        if(snoop_filter && cache_sets * cache_ways > 65535)
+            throw std::runtime_error("Error, the snoop filter counts up to 65535 lines per cache");
+        if(c2c_workers < 1)
+            throw std::runtime_error("Error, caches need at least one cache-to-cache worker");
+        if(link_latency < 0 || link_bytes < 1)
+            throw std::runtime_error("Error, links need a latency and a bandwidth");
+        if(memory_controllers < 1 || memory_controllers > MAX_CPUS)
+            throw std::runtime_error("Error, memory needs 1 to MAX_CPUS controllers");
+        if(bus_interval < 1)
+            throw std::runtime_error("Error, bus statistics interval needs at least one cycle");
+        if(numa_nodes < 0 || numa_link_latency < 0 || numa_link_bytes < 1)
+            throw std::runtime_error("Error, NUMA links need a latency and a bandwidth");
+        if(numa_placement != "first-touch" && numa_placement != "interleave")
+            throw std::runtime_error("Error, NUMA placement is first-touch or interleave");
+        if(dram_channels < 1 || dram_banks < 1 || dram_row_size < CACHELINE_SIZE || dram_write_queue < 1 ||
+           dram_write_low > dram_write_high || dram_write_high > dram_write_queue)
+            throw std::runtime_error("Error, invalid DRAM organization");
+        if(dram_trcd < 0 || dram_tcas < 0 || dram_trp < 0 || dram_tburst < 1)
+            throw std::runtime_error("Error, invalid DRAM timings");
+        if(checkpoint.empty() != (checkpoint_at == 0))
+            throw std::runtime_error("Error, --checkpoint and --checkpoint-at go together");
+        if(rob < 0 || lsq < 1 || lsq > MAX_MSHRS || issue_width < 1)
+            throw std::runtime_error("Error, out-of-order core needs a window, 1 to MAX_MSHRS LSQ slots and issue width of 1 or more");
+        if(rob > 0 && lt_entries() != 0)
+            throw std::runtime_error("Error, the out-of-order core has no loosely timed mode");
+    }
+
+    // Writes all keys in the format of the configuration file
+    void print(FILE* f) const{
+        std::vector<entry_t> e = const_cast<Config*>(this)->entries();
+        for(unsigned int i = 0; i < e.size(); ++i){
+            switch(e[i].kind){
+                case KIND_INT: fprintf(f, "%s = %d\n", e[i].name, *(int*)e[i].value); break;
+                case KIND_UINT64: fprintf(f, "%s = %lu\n", e[i].name, (unsigned long)*(uint64_t*)e[i].value); break;
+                case KIND_BOOL: fprintf(f, "%s = %d\n", e[i].name, *(bool*)e[i].value ? 1 : 0); break;
+                case KIND_STRING: fprintf(f, "%s = %s\n", e[i].name, ((std::string*)e[i].value)->c_str()); break;
+            }
+        }
+    }
+
+    private:
+    enum Kind
+    {
+        KIND_INT,
+        KIND_UINT64,
+        KIND_BOOL,
+        KIND_STRING,
+    };
+
+    struct entry_t {
+        const char* name;
+        Kind kind;
+        void* value;
+    };
+
+    std::vector<entry_t> entries(){
+        entry_t e[] = {
+            {"trace", KIND_STRING, &trace},
+            {"synthetic", KIND_STRING, &synthetic},
+            {"cpus", KIND_INT, &cpus},
+            {"protocol", KIND_STRING, &protocol},
+            {"topology", KIND_STRING, &topology},
+            {"functional", KIND_BOOL, &functional},
+            {"prefetch", KIND_BOOL, &prefetch},
+            {"clocked", KIND_BOOL, &clocked},
+            {"cache-sets", KIND_INT, &cache_sets},
+            {"cache-ways", KIND_INT, &cache_ways},
+            {"snoop-filter", KIND_BOOL, &snoop_filter},
+            {"c2c-workers", KIND_INT, &c2c_workers},
+            {"link-latency", KIND_INT, &link_latency},
+            {"link-bytes", KIND_INT, &link_bytes},
+            {"memory-controllers", KIND_INT, &memory_controllers},
+            {"memory-interleave", KIND_STRING, &memory_interleave},
+            {"numa-nodes", KIND_INT, &numa_nodes},
+            {"numa-placement", KIND_STRING, &numa_placement},
+            {"numa-link-latency", KIND_INT, &numa_link_latency},
+            {"numa-link-bytes", KIND_INT, &numa_link_bytes},
+            {"dram-channels", KIND_INT, &dram_channels},
+            {"dram-banks", KIND_INT, &dram_banks},
+            {"dram-row-size", KIND_INT, &dram_row_size},
+            {"dram-open-page", KIND_BOOL, &dram_open_page},
+            {"dram-trcd", KIND_INT, &dram_trcd},
+            {"dram-tcas", KIND_INT, &dram_tcas},
+            {"dram-trp", KIND_INT, &dram_trp},
+            {"dram-tburst", KIND_INT, &dram_tburst},
+            {"dram-write-queue", KIND_INT, &dram_write_queue},
+            {"dram-write-high", KIND_INT, &dram_write_high},
+            {"dram-write-low", KIND_INT, &dram_write_low},
+            {"lt", KIND_BOOL, &lt},
+            {"lt-warmup", KIND_UINT64, &lt_warmup},
+            {"rob", KIND_INT, &rob},
+            {"lsq", KIND_INT, &lsq},
+            {"issue-width", KIND_INT, &issue_width},
+            {"latency-csv", KIND_STRING, &latency_csv},
+            {"bus-csv", KIND_STRING, &bus_csv},
+            {"bus-interval", KIND_UINT64, &bus_interval},
+            {"checkpoint", KIND_STRING, &checkpoint},
+            {"checkpoint-at", KIND_UINT64, &checkpoint_at},
+            {"restore", KIND_STRING, &restore},
+        };
+        return std::vector<entry_t>(e, e + sizeof(e) / sizeof(e[0]));
+    }
+
+    static void parse(const entry_t& e, const std::string& value){
+        const char* s = value.c_str();
+        char* end = NULL;
+        switch(e.kind){
+            case KIND_INT: *(int*)e.value = strtol(s, &end, 0); break;
+            case KIND_UINT64: *(uint64_t*)e.value = strtoull(s, &end, 0); break;
+            case KIND_BOOL:
+                if(value == "1" || strcasecmp(s, "true") == 0 || strcasecmp(s, "yes") == 0 || strcasecmp(s, "on") == 0)
+                    *(bool*)e.value = true;
+                else if(value == "0" || strcasecmp(s, "false") == 0 || strcasecmp(s, "no") == 0 || strcasecmp(s, "off") == 0)
+                    *(bool*)e.value = false;
+                else
+                    throw std::runtime_error(std::string("Error, ") + e.name + " has to be true or false: " + value);
+                return;
+            case KIND_STRING: *(std::string*)e.value = value; return;
+        }
+        if(value.empty() || *end != 0)
+            throw std::runtime_error(std::string("Error, ") + e.name + " has to be a number: " + value);
+    }
+
+    static std::string trim(const std::string& s){
+        size_t begin = s.find_first_not_of(" \t\r\n");
+        if(begin == std::string::npos)
+            return "";
+        return s.substr(begin, s.find_last_not_of(" \t\r\n") - begin + 1);
+    }
+};
+
+extern Config config;
+
+#endif
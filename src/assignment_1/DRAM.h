@@ -0,0 +1,319 @@
+#ifndef DRAM_MOD
+#define DRAM_MOD
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <list>
+#include <algorithm>
+#include "utils.h"
+#include "Checkpoint.h"
+
+// Timings of DRAM commands in cycles of the system clock
+struct dram_timing_t {
+    int tRCD;   // row activation to column command
+    int tCAS;   // column command to the first data
+    int tRP;    // precharge of the open row
+    int tBURST; // transfer of one cacheline on the channel data bus
+};
+
+struct dram_request {
+    int id;
+    int addr;
+    int func;
+    bool write;         // write-back, otherwise demand read
+    uint64_t arrival;   // cycle when request entered the controller
+    uint64_t done;      // cycle when the data transfer is finished
+    int channel;
+    int bank;
+    int row;
+};
+
+// Banked DRAM controller. Every channel has its own banks and data bus, every
+// bank has a row buffer. Pending requests are scheduled FR-FCFS: the oldest
+// request which hits an open row goes first, otherwise the oldest request
+// to a bank which is ready. Requests to different banks are overlapped,
+// only their data transfers are serialized on the channel.
+//
+// With the open page policy a row stays open after the access, so the next
+// access to it costs only tCAS, while an access to another row of the bank
+// costs tRP + tRCD + tCAS. With the closed page policy every access costs
+// tRCD + tCAS and the bank precharges right after it.
+//
+// Reads and write-backs wait in separate queues. Demand reads have priority,
+// writes are posted: they are acknowledged as soon as they enter the write
+// queue and go to DRAM later. When the write queue reaches the high watermark
+// the controller drains writes only, until it falls to the low watermark.
+// A read of a line which is still in the write queue is forwarded from there.
+class DramController {
+    public:
+    struct queue_stats_t {
+        unsigned long requests;
+        unsigned long max_occupancy;
+        uint64_t occupancy_cycles;   // sum of occupancy over cycles, for the average
+        unsigned long total_wait;    // sum of cycles from arrival to issue to DRAM
+    };
+
+    struct stats_t {
+        unsigned long requests;
+        unsigned long row_hits;       // row was open
+        unsigned long row_misses;     // bank was precharged
+        unsigned long row_conflicts;  // other row was open
+        unsigned long total_latency;  // sum of cycles from arrival to done
+        unsigned long forwarded;      // reads served from the write queue
+        unsigned long merged;         // write-backs merged into a queued write
+        unsigned long drains;         // how many times the high watermark was reached
+        unsigned long write_stalls;   // write-backs which found the write queue full
+        uint64_t cycles;              // cycles covered by the occupancy statistics
+        queue_stats_t reads;
+        queue_stats_t writes;
+    } stats;
+
+    DramController(int channels_, int banks_, int row_size_, bool open_page_, const dram_timing_t& timing_,
+                   int write_queue_size_, int write_high_, int write_low_)
+    : channels(channels_), banks(banks_), open_page(open_page_), timing(timing_),
+      write_queue_size(write_queue_size_), write_high(write_high_), write_low(write_low_), draining(false)
+    {
+        lines_per_row = std::max(1, row_size_ / CACHELINE_SIZE);
+        bank_state.resize(channels * banks);
+        data_bus_free.resize(channels, 0);
+        memset(&stats, 0x0, sizeof(stats));
+        last_sample = 0;
+    }
+
+    // line is the number of the line among the lines of this controller,
+    // it picks the channel, the bank and the row
+    void enqueue(int id, int addr, unsigned int line, int func, bool write, uint64_t now){
+        sample(now);
+        dram_request r;
+        r.id = id;
+        r.addr = addr;
+        r.func = func;
+        r.write = write;
+        r.arrival = now;
+        r.done = 0;
+        // row:bank:channel:column mapping, consequative lines stay in one row
+        unsigned int rest = line / lines_per_row;
+        r.channel = rest % channels;
+        rest /= channels;
+        r.bank = rest % banks;
+        r.row = rest / banks;
+
+        if(write){
+            ++stats.writes.requests;
+            if(find_write(addr) != NULL){
+                // newer data of the same line replaces the queued one
+                ++stats.merged;
+                r.done = now;
+                acks.push_back(r);
+            } else if(write_queue.size() < (size_t)write_queue_size){
+                write_queue.push_back(r);
+                r.done = now;
+                acks.push_back(r);
+            } else {
+                // no space, the write-back is acknowledged when it enters the queue
+                ++stats.write_stalls;
+                blocked_writes.push_back(r);
+            }
+            stats.writes.max_occupancy = std::max(stats.writes.max_occupancy, (unsigned long)write_queue.size());
+            return;
+        }
+
+        ++stats.reads.requests;
+        if(find_write(addr) != NULL){
+            // read after write: the data is taken from the write queue
+            ++stats.forwarded;
+            r.done = now + 1;
+            forwarded.push_back(r);
+            return;
+        }
+        read_queue.push_back(r);
+        stats.reads.max_occupancy = std::max(stats.reads.max_occupancy, (unsigned long)read_queue.size());
+    }
+
+    // Issues at most one request per channel in this cycle and moves
+    // requests with finished data transfers to done.
+    void tick(uint64_t now, std::vector<dram_request>& done){
+        sample(now);
+        if(!draining && write_queue.size() >= (size_t)write_high){
+            draining = true;
+            ++stats.drains;
+        } else if(draining && write_queue.size() <= (size_t)write_low)
+            draining = false;
+
+        for(int c = 0; c < channels; ++c)
+            schedule(c, now);
+
+        // freed slots of the write queue are taken by stalled write-backs
+        while(!blocked_writes.empty() && write_queue.size() < (size_t)write_queue_size){
+            dram_request r = blocked_writes.front();
+            blocked_writes.pop_front();
+            write_queue.push_back(r);
+            r.done = now;
+            acks.push_back(r);
+        }
+
+        for(std::list<dram_request>::iterator it = acks.begin(); it != acks.end(); it = acks.erase(it))
+            done.push_back(*it);
+        for(std::list<dram_request>::iterator it = forwarded.begin(); it != forwarded.end();){
+            if(it->done <= now){
+                stats.total_latency += it->done - it->arrival;
+                done.push_back(*it);
+                it = forwarded.erase(it);
+            } else ++it;
+        }
+        for(std::list<dram_request>::iterator it = in_flight.begin(); it != in_flight.end();){
+            if(it->done <= now){
+                if(!it->write){
+                    // writes were already acknowledged
+                    stats.total_latency += it->done - it->arrival;
+                    done.push_back(*it);
+                }
+                it = in_flight.erase(it);
+            } else ++it;
+        }
+    }
+
+    bool idle() const{
+        return read_queue.empty() && write_queue.empty() && blocked_writes.empty() &&
+               in_flight.empty() && acks.empty() && forwarded.empty();
+    }
+
+    // Earliest cycle from now on when tick() may change anything, as long as no
+    // new request arrives. It's conservative: ticks before it are no-ops, a tick
+    // at it may be a no-op as well (a queue could wait for the other one).
+    uint64_t next_event(uint64_t now) const{
+        if(!acks.empty() || !blocked_writes.empty())
+            return now;
+        uint64_t next = UINT64_MAX;
+        for(std::list<dram_request>::const_iterator it = forwarded.begin(); it != forwarded.end(); ++it)
+            next = std::min(next, it->done);
+        for(std::list<dram_request>::const_iterator it = in_flight.begin(); it != in_flight.end(); ++it)
+            next = std::min(next, it->done);
+        for(std::list<dram_request>::const_iterator it = read_queue.begin(); it != read_queue.end(); ++it)
+            next = std::min(next, bank_state[it->channel * banks + it->bank].ready);
+        for(std::list<dram_request>::const_iterator it = write_queue.begin(); it != write_queue.end(); ++it)
+            next = std::min(next, bank_state[it->channel * banks + it->bank].ready);
+        return std::max(next, now);
+    }
+
+    size_t queued() const{
+        return read_queue.size() + write_queue.size() + blocked_writes.size();
+    }
+
+    // Cycles in the state are absolute, the restored run continues from the same cycle
+    void checkpoint(Checkpoint& cp){
+        cp.tag("DRAM");
+        cp.expect(channels, "DRAM channels");
+        cp.expect(banks, "DRAM banks");
+        cp.io(bank_state);
+        cp.io(data_bus_free);
+        cp.io(draining);
+        cp.io(last_sample);
+        cp.io(stats);
+        cp.io(read_queue);
+        cp.io(write_queue);
+        cp.io(blocked_writes);
+        cp.io(acks);
+        cp.io(forwarded);
+        cp.io(in_flight);
+    }
+
+    private:
+    struct bank_t {
+        int open_row;       // -1 if the bank is precharged
+        uint64_t ready;     // cycle when bank accepts the next command
+        bank_t() : open_row(-1), ready(0) {}
+    };
+
+    int channels;
+    int banks;
+    int lines_per_row;
+    bool open_page;
+    dram_timing_t timing;
+    std::vector<bank_t> bank_state;
+    std::vector<uint64_t> data_bus_free;
+    int write_queue_size;
+    int write_high;
+    int write_low;
+    bool draining;
+    uint64_t last_sample;
+    std::list<dram_request> read_queue;     // in arrival order
+    std::list<dram_request> write_queue;    // in arrival order
+    std::list<dram_request> blocked_writes; // write-backs waiting for space in the write queue
+    std::list<dram_request> acks;           // posted writes to acknowledge
+    std::list<dram_request> forwarded;      // reads served from the write queue
+    std::list<dram_request> in_flight;
+
+    const dram_request* find_write(int addr) const{
+        int line = addr & ~(CACHELINE_SIZE - 1);
+        for(std::list<dram_request>::const_iterator it = write_queue.begin(); it != write_queue.end(); ++it)
+            if((it->addr & ~(CACHELINE_SIZE - 1)) == line)
+                return &*it;
+        for(std::list<dram_request>::const_iterator it = blocked_writes.begin(); it != blocked_writes.end(); ++it)
+            if((it->addr & ~(CACHELINE_SIZE - 1)) == line)
+                return &*it;
+        return NULL;
+    }
+
+    // accumulates queue occupancy over the cycles since the last sample
+    void sample(uint64_t now){
+        if(now <= last_sample) return;
+        uint64_t cycles = now - last_sample;
+        stats.cycles += cycles;
+        stats.reads.occupancy_cycles += read_queue.size() * cycles;
+        stats.writes.occupancy_cycles += write_queue.size() * cycles;
+        last_sample = now;
+    }
+
+    void schedule(int channel, uint64_t now){
+        // reads first, unless writes have to be drained or there is nothing else to do
+        bool has_reads = false;
+        for(std::list<dram_request>::iterator it = read_queue.begin(); it != read_queue.end() && !has_reads; ++it)
+            has_reads = it->channel == channel;
+        std::list<dram_request>& pending = (draining || !has_reads) ? write_queue : read_queue;
+        queue_stats_t& qstats = (&pending == &read_queue) ? stats.reads : stats.writes;
+
+        std::list<dram_request>::iterator pick = pending.end();
+        for(std::list<dram_request>::iterator it = pending.begin(); it != pending.end(); ++it){
+            if(it->channel != channel) continue;
+            bank_t& b = bank_state[it->channel * banks + it->bank];
+            if(b.ready > now) continue;
+            if(open_page && b.open_row == it->row){
+                pick = it; // first ready: the oldest row hit wins
+                break;
+            }
+            if(pick == pending.end())
+                pick = it; // otherwise first come first served
+        }
+        if(pick == pending.end()) return;
+
+        bank_t& b = bank_state[pick->channel * banks + pick->bank];
+        int latency;
+        if(b.open_row == pick->row){
+            latency = timing.tCAS;
+            ++stats.row_hits;
+        } else if(b.open_row == -1){
+            latency = timing.tRCD + timing.tCAS;
+            ++stats.row_misses;
+        } else {
+            latency = timing.tRP + timing.tRCD + timing.tCAS;
+            ++stats.row_conflicts;
+        }
+        ++stats.requests;
+        qstats.total_wait += now - pick->arrival;
+        pick->done = std::max(now + latency, data_bus_free[channel]) + timing.tBURST;
+        data_bus_free[channel] = pick->done;
+        if(open_page){
+            b.open_row = pick->row;
+            b.ready = now + latency;
+        } else {
+            b.open_row = -1;
+            b.ready = pick->done + timing.tRP;
+        }
+        in_flight.push_back(*pick);
+        pending.erase(pick);
+    }
+};
+
+#endif
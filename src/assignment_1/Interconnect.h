@@ -0,0 +1,269 @@
+#ifndef INTERCONNECT_MOD
+#define INTERCONNECT_MOD
+
+#include <deque>
+#include <vector>
+#include <math.h>
+#include "Bus.h"
+
+// Interconnect made of several bus segments. Cachelines are interleaved
+// between segments by address, so every segment is the home of its own part
+// of the address space and keeps snooping of those lines ordered, while
+// transactions for different segments go in parallel.
+//
+// Segments (and the memory controllers) are placed on the stops of the topology:
+//   MULTIBUS - every CPU is connected to every segment, no extra latency
+//   RING     - bidirectional ring, a message takes the shortest direction
+//   MESH     - 2D mesh with XY routing
+// A request pays the link latency for every hop from the requestor to the home
+// segment, a response pays it for every hop from the home segment back to the
+// requestor. Snoops are ordered by the home segment, we don't model their hops
+// separately, otherwise the protocol wouldn't stay atomic.
+class Interconnect : public Bus_if, public sc_module
+{
+  public:
+    enum Topology
+    {
+        TOPOLOGY_BUS,
+        TOPOLOGY_MULTIBUS,
+        TOPOLOGY_RING,
+        TOPOLOGY_MESH,
+    };
+
+    sc_in<bool> Port_CLK;
+
+    SC_HAS_PROCESS(Interconnect);
+    // nodes is the number of stops of the ring/mesh (one per CPU),
+    // link_latency is the number of cycles per hop,
+    // transfer_cycles is the number of cycles a cacheline occupies a segment.
+    Interconnect(sc_module_name name_, Topology topology_, int segments_, int nodes_,
+                 int link_latency_, int transfer_cycles_)
+    : sc_module(name_), topology(topology_), nodes(nodes_), link_latency(link_latency_)
+    {
+        if(segments_ < 1 || nodes_ < 1)
+            throw std::runtime_error("Error, interconnect needs at least one segment and one node");
+        mesh_width = (int)ceil(sqrt((double)nodes));
+        for(int i = 0; i < segments_; ++i){
+            char name[32];
+            snprintf(name, sizeof(name), "segment_%d", i);
+            Bus* segment = new Bus(name);
+            segment->Port_CLK(Port_CLK);
+            segment->transfer_cycles = transfer_cycles_;
+            segments.push_back(segment);
+            any_request |= segment->Port_BusFunc.value_changed_event();
+            for(int c = 0; c < MAX_CPUS; ++c)
+                snoop_arrived[c] |= segment->snoop_arrived[c];
+            any_change |= segment->Port_BusFunc.value_changed_event();
+            any_change |= segment->Port_BusAddr.value_changed_event();
+            any_change |= segment->Port_ProcID.value_changed_event();
+        }
+        snoops.resize(MAX_CPUS);
+        memory_requests.resize(memory_map.size());
+    }
+
+    ~Interconnect()
+    {
+        for(unsigned int i = 0; i < segments.size(); ++i)
+            delete segments[i];
+    }
+
+    static Topology topology_by_name(const char* name){
+        if(strcasecmp(name, "bus") == 0) return TOPOLOGY_BUS;
+        if(strcasecmp(name, "multibus") == 0) return TOPOLOGY_MULTIBUS;
+        if(strcasecmp(name, "ring") == 0) return TOPOLOGY_RING;
+        if(strcasecmp(name, "mesh") == 0) return TOPOLOGY_MESH;
+        throw std::runtime_error(std::string("Error, unknown interconnect topology: ") + name);
+    }
+
+    virtual bool read(int proc_id, int addr){
+        if(!home(addr)->read(proc_id, addr))
+            return false;
+        travel(node_of_cpu(proc_id), node_of(addr));
+        return true;
+    }
+
+    virtual bool write(int proc_id, int addr, const cacheline_data& data){
+        if(!home(addr)->write(proc_id, addr, data))
+            return false;
+        travel(node_of_cpu(proc_id), node_of(addr));
+        return true;
+    }
+
+    virtual int wait_for_response(int proc_id, int addr, cacheline_data* data){
+        int res = home(addr)->wait_for_response(proc_id, addr, data);
+        travel(node_of(addr), node_of_cpu(proc_id));
+        return res;
+    }
+
+    virtual struct request wait_for_any(int proc_id, SnoopFilter* filter){
+        // several segments could carry requests in the same cycle,
+        // so they are queued per snooping cache
+        std::deque<request>& pending = snoops[proc_id];
+        for(unsigned int i = 0; i < segments.size(); ++i)
+            segments[i]->listen(proc_id, filter);
+        while(true){
+            struct request req;
+            for(unsigned int i = 0; i < segments.size(); ++i)
+                if(segments[i]->snoop(proc_id, req))
+                    pending.push_back(req);
+            if(!pending.empty())
+                break;
+            wait(snoop_arrived[proc_id]); // only segments with a request for this cache wake it up
+        }
+        struct request res = pending.front();
+        pending.pop_front();
+        return res;
+    }
+
+    virtual bool cache_to_cache(int proc_id, int source_id, int addr, const cacheline_data& data, bool flush){
+        travel(node_of_cpu(source_id), node_of(addr));
+        return home(addr)->cache_to_cache(proc_id, source_id, addr, data, flush);
+    }
+
+    virtual bool cacheline_invalidate(int addr, int proc_id){
+        if(!home(addr)->cacheline_invalidate(addr, proc_id))
+            return false;
+        travel(node_of_cpu(proc_id), node_of(addr));
+        return true;
+    }
+
+    virtual bool update(int addr, int proc_id, const cacheline_data& data){
+        if(!home(addr)->update(addr, proc_id, data))
+            return false;
+        travel(node_of_cpu(proc_id), node_of(addr));
+        return true;
+    }
+
+    virtual void assert_shared(int proc_id, int addr){
+        home(addr)->assert_shared(proc_id, addr);
+    }
+
+    virtual bool is_shared(int proc_id, int addr){
+        return home(addr)->is_shared(proc_id, addr);
+    }
+
+    virtual bool supplied_by_cache(int proc_id, int addr){
+        return home(addr)->supplied_by_cache(proc_id, addr);
+    }
+
+    virtual void assert_supplied(int proc_id, int addr){
+        home(addr)->assert_supplied(proc_id, addr);
+    }
+
+    virtual bool is_supplied(int proc_id, int addr){
+        return home(addr)->is_supplied(proc_id, addr);
+    }
+
+    virtual void memory_response(int proc_id, int addr, const cacheline_data& data){
+        travel(node_of_controller(memory_map.controller_of(addr, requestor_cpu(proc_id))), node_of(addr));
+        home(addr)->memory_response(proc_id, addr, data);
+    }
+
+    virtual struct request get_next_request(int controller){
+        // every controller samples all segments and keeps the requests for its lines
+        std::deque<request>& pending = memory_requests[controller];
+        while(pending.empty()){
+            if(!config.clocked) // nothing to sample until the wires of some segment change
+                wait(any_change);
+            wait(Port_CLK.default_event());
+            struct request req;
+            for(unsigned int i = 0; i < segments.size(); ++i)
+                if(segments[i]->memory_request(controller, req))
+                    pending.push_back(req);
+        }
+        struct request res = pending.front();
+        pending.pop_front();
+        return res;
+    }
+
+    virtual void memory_controller_wait(){
+        wait(any_request);
+    }
+
+    virtual bus_traffic_t get_traffic(){
+        bus_traffic_t sum;
+        memset(&sum, 0x0, sizeof(sum));
+        for(unsigned int i = 0; i < segments.size(); ++i){
+            bus_traffic_t t = segments[i]->get_traffic();
+            sum.reads += t.reads;
+            sum.writebacks += t.writebacks;
+            sum.invalidates += t.invalidates;
+            sum.updates += t.updates;
+            sum.c2c += t.c2c;
+            sum.responses += t.responses;
+        }
+        return sum;
+    }
+
+    virtual void checkpoint(Checkpoint& cp){
+        cp.expect((int)segments.size(), "number of segments");
+        for(unsigned int i = 0; i < segments.size(); ++i)
+            segments[i]->checkpoint(cp);
+        for(unsigned int i = 0; i < snoops.size(); ++i)
+            cp.io(snoops[i]);
+        cp.expect((int)memory_requests.size(), "number of memory controllers");
+        for(unsigned int i = 0; i < memory_requests.size(); ++i)
+            cp.io(memory_requests[i]);
+    }
+
+    void print_usage(uint64_t cycles){
+        for(unsigned int i = 0; i < segments.size(); ++i)
+            segments[i]->print_usage(i, cycles);
+    }
+
+    void print_usage_csv(FILE* f){
+        for(unsigned int i = 0; i < segments.size(); ++i)
+            segments[i]->print_usage_csv(f, i);
+    }
+
+    // number of hops between two stops of the topology
+    int hops(int from, int to){
+        int d;
+        switch(topology){
+            case TOPOLOGY_RING:
+                d = abs(from - to);
+                return std::min(d, nodes - d);
+            case TOPOLOGY_MESH:
+                return abs(from % mesh_width - to % mesh_width) + abs(from / mesh_width - to / mesh_width);
+            default:
+                return 0;
+        }
+    }
+
+  private:
+    Topology topology;
+    int nodes;
+    int link_latency;
+    int mesh_width;
+    std::vector<Bus*> segments;
+    std::vector<std::deque<request> > snoops; // per snooping cache
+    std::vector<std::deque<request> > memory_requests; // per memory controller
+    sc_event_or_list any_request;
+    sc_event_or_list snoop_arrived[MAX_CPUS]; // of all segments, per snooping cache
+    sc_event_or_list any_change; // any wire of any segment
+
+    Bus* home(int addr){
+        return segments[(((unsigned int)addr) >> CACHEINDEX_SHIFT) % segments.size()];
+    }
+
+    int node_of(int addr){
+        // segments are spread evenly over the stops
+        int segment = (((unsigned int)addr) >> CACHEINDEX_SHIFT) % segments.size();
+        return segment * nodes / segments.size();
+    }
+
+    int node_of_controller(int controller){
+        // controllers are spread evenly over the stops, the first one is next to the first CPU
+        return controller * nodes / memory_map.size();
+    }
+
+    int node_of_cpu(int proc_id){
+        return requestor_cpu(proc_id) % nodes;
+    }
+
+    void travel(int from, int to){
+        wait_edges(Port_CLK, hops(from, to) * link_latency);
+    }
+};
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef LATENCYHISTOGRAM_MOD
+#define LATENCYHISTOGRAM_MOD
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+// Log-linear histogram of latencies in cycles (the way HdrHistogram does it).
+// Values below SUB_BUCKETS get a bucket each, above that every power of two is
+// split into SUB_BUCKETS equal buckets, so any value is off by at most 1/16
+// of itself and recording is a couple of shifts and an increment.
+class LatencyHistogram {
+    public:
+    static const int SUB_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int BUCKETS = SUB_BUCKETS + (64 - SUB_BITS) * SUB_BUCKETS;
+
+    LatencyHistogram(){
+        reset();
+    }
+
+    void reset(){
+        memset(counts, 0x0, sizeof(counts));
+        count = 0;
+        total = 0;
+        min_value = UINT64_MAX;
+        max_value = 0;
+    }
+
+    void record(uint64_t value){
+        ++counts[index_of(value)];
+        ++count;
+        total += value;
+        min_value = std::min(min_value, value);
+        max_value = std::max(max_value, value);
+    }
+
+    double mean() const{
+        return count ? total / (double)count : 0.0;
+    }
+
+    // Smallest value which is not below p (0..1) of the recorded values,
+    // up to the bucket resolution
+    uint64_t percentile(double p) const{
+        if(count == 0) return 0;
+        uint64_t rank = std::max((uint64_t)1, (uint64_t)(p * count + 0.5));
+        uint64_t seen = 0;
+        for(int i = 0; i < BUCKETS; ++i){
+            seen += counts[i];
+            if(seen >= rank)
+                return std::min(highest_of(i), max_value);
+        }
+        return max_value;
+    }
+
+    // Writes non-empty buckets as "<prefix>,low,high,count" lines
+    void print_csv(FILE* f, const char* prefix) const{
+        for(int i = 0; i < BUCKETS; ++i)
+            if(counts[i] != 0)
+                fprintf(f, "%s,%lu,%lu,%lu\n", prefix, (unsigned long)lowest_of(i),
+                        (unsigned long)highest_of(i), (unsigned long)counts[i]);
+    }
+
+    uint64_t count;
+    uint64_t total;
+    uint64_t min_value;
+    uint64_t max_value;
+
+    private:
+    uint64_t counts[BUCKETS];
+
+    static int index_of(uint64_t value){
+        if(value < (uint64_t)SUB_BUCKETS)
+            return (int)value;
+        int magnitude = 63 - __builtin_clzll(value); // >= SUB_BITS here
+        int shift = magnitude - SUB_BITS;
+        return SUB_BUCKETS + shift * SUB_BUCKETS + (int)((value >> shift) - SUB_BUCKETS);
+    }
+
+    static uint64_t lowest_of(int index){
+        if(index < SUB_BUCKETS)
+            return index;
+        int shift = (index - SUB_BUCKETS) / SUB_BUCKETS;
+        int sub = (index - SUB_BUCKETS) % SUB_BUCKETS;
+        return (uint64_t)(SUB_BUCKETS + sub) << shift;
+    }
+
+    static uint64_t highest_of(int index){
+        if(index < SUB_BUCKETS)
+            return index;
+        int shift = (index - SUB_BUCKETS) / SUB_BUCKETS;
+        return lowest_of(index) + ((uint64_t)1 << shift) - 1;
+    }
+};
+
+#endif
@@ -4,6 +4,10 @@
 #include "utils.h"
 #include "iostream"
 #include "Bus.h"
+#include "Clock.h"
+#include "DRAM.h"
+#include "SparseMemory.h"
+#include "Config.h"
 
 SC_MODULE(Memory)
 {
@@ -17,6 +21,7 @@ public:
     FUNC_INVALIDATE,
     FUNC_RESPONSE,
     FUNC_REQUESTED,
+    FUNC_UPDATE,
 };
 
     enum RetCode
@@ -28,95 +33,228 @@ public:
     sc_port<Bus_if> bus{"mem_to_bus"};
     // sc_inout_rv<32> Port_Data;
 
-    SC_CTOR(Memory)
+    const int controller; // owns the lines memory_map gives to it, and is the NUMA node
+
+    // Requests by the CPU which sent them and the link of the node, NUMA mode only
+    struct numa_stats_t {
+        uint64_t local[MAX_CPUS];
+        uint64_t remote[MAX_CPUS];  // came from other nodes
+        uint64_t transfers;         // lines moved over the link
+        uint64_t link_busy;         // cycles the link carried lines
+        uint64_t link_wait;         // cycles lines waited for the link
+    } numa;
+
+    SC_HAS_PROCESS(Memory);
+    Memory(sc_module_name name_, int controller_)
+    : sc_module(name_), controller(controller_),
+      dram(config.dram_channels, config.dram_banks, config.dram_row_size, config.dram_open_page, configured_timing(),
+           config.dram_write_queue, config.dram_write_high, config.dram_write_low),
+      link_free(0), responding(false)
     {
-        SC_THREAD(execute); //  performing memory accesses and sends responses
+        memset(&numa, 0x0, sizeof(numa));
+        SC_THREAD(execute); //  performing memory accesses
+        SC_THREAD(respond); //  sends responses of finished accesses to the bus
         SC_THREAD(snoop);   // performing snooping of the bus to collect requests
         sensitive << Port_CLK.pos();
         dont_initialize();
-        m_data = new int[MEM_SIZE];
     }
 
-    ~Memory()
-    {
-        delete[] m_data;
+    void print_stats(){
+        const DramController::stats_t& st = dram.stats;
+        if(memory_map.size() > 1)
+            printf("Memory controller %d\n", controller);
+        printf("DRAM\tRequests\tRowHit\tRowMiss\tRowConfl\tAvgLatency\n");
+        printf("\t%lu\t%lu\t%lu\t%lu\t%f\n", st.requests, st.row_hits, st.row_misses, st.row_conflicts,
+               st.reads.requests ? st.total_latency / (double)st.reads.requests : 0.0);
+        printf("Queue\tRequests\tAvgOcc\tMaxOcc\tAvgWait\n");
+        print_queue_stats("Read", st.reads, st.cycles);
+        print_queue_stats("Write", st.writes, st.cycles);
+        printf("Forwarded reads %lu, merged writes %lu, write drains %lu, write stalls %lu\n",
+               st.forwarded, st.merged, st.drains, st.write_stalls);
+        printf("Memory footprint %lu KB, %lu pages touched (%s)\n", m_data.footprint() / 1024,
+               m_data.touched_pages(), m_data.mmapped() ? "mmap" : "page table");
+    }
+
+    // One row of the table of all controllers, bandwidth is in bytes per cycle
+    // of the whole run, occupancy is the average of requests in the queues
+    void print_summary(uint64_t cycles){
+        const DramController::stats_t& st = dram.stats;
+        unsigned long requests = st.reads.requests + st.writes.requests;
+        printf("%d\t%lu\t%lu\t%lu\t%f\t%f\t%f\t%f\n", controller, requests, st.reads.requests, st.writes.requests,
+               cycles ? (double)requests * CACHELINE_SIZE / cycles : 0.0,
+               st.cycles ? (double)(st.reads.occupancy_cycles + st.writes.occupancy_cycles) / st.cycles : 0.0,
+               st.reads.requests ? st.total_latency / (double)st.reads.requests : 0.0,
+               st.requests ? 100.0 * st.row_hits / st.requests : 0.0);
+    }
+
+    // One row of the NUMA table: requests of the own CPUs and of the others,
+    // how busy the link was and how long lines waited for it
+    void print_numa(uint64_t cycles){
+        uint64_t local = 0, remote = 0;
+        for(int i = 0; i < MAX_CPUS; ++i){
+            local += numa.local[i];
+            remote += numa.remote[i];
+        }
+        printf("%d\t%lu\t%lu\t%f\t%f\t%f\n", controller, (unsigned long)local, (unsigned long)remote,
+               local + remote ? 100.0 * remote / (local + remote) : 0.0,
+               cycles ? 100.0 * numa.link_busy / cycles : 0.0,
+               numa.transfers ? (double)numa.link_wait / numa.transfers : 0.0);
+    }
+
+    void checkpoint(Checkpoint& cp){
+        cp.tag("MEMORY");
+        cp.expect(controller, "memory controller order");
+        m_data.checkpoint(cp);
+        dram.checkpoint(cp);
+        if(cp.saving && responding)
+            throw std::runtime_error("Error, a memory response is in flight at the checkpoint");
+        cp.io(responses);
+        cp.io(in_transit);
+        cp.io(link_free);
+        cp.io(numa);
     }
 
 private:
-    int* m_data;
-    std::queue<request> requests;
+    SparseMemory m_data;
+    DramController dram;
+    std::queue<dram_request> responses; // finished accesses waiting for the bus
+    std::list<dram_request> in_transit; // responses to other NUMA nodes by the cycle they get there
+    uint64_t link_free;                 // first cycle the link of the node is free
+    bool responding;                    // respond() has taken a response off the queue and sends it
+    sc_event request_arrived;
+    sc_event response_ready;
+
+    static void print_queue_stats(const char* name, const DramController::queue_stats_t& q, uint64_t cycles){
+        printf("%s\t%lu\t%f\t%lu\t%f\n", name, q.requests,
+               cycles ? q.occupancy_cycles / (double)cycles : 0.0, q.max_occupancy,
+               q.requests ? q.total_wait / (double)q.requests : 0.0);
+    }
+
+    static dram_timing_t configured_timing(){
+        dram_timing_t t;
+        t.tRCD = config.dram_trcd;
+        t.tCAS = config.dram_tcas;
+        t.tRP = config.dram_trp;
+        t.tBURST = config.dram_tburst;
+        return t;
+    }
+
+    bool remote(int id) const{
+        return memory_map.is_numa() && memory_map.node_of_cpu(requestor_cpu(id)) != controller;
+    }
+
+    // Moves one line over the link of the node, lines go one after another.
+    // Returns the cycle when the transfer is done.
+    uint64_t link_transfer(uint64_t now){
+        uint64_t start = std::max(now, link_free);
+        uint64_t cycles = std::max(1, CACHELINE_SIZE / config.numa_link_bytes);
+        ++numa.transfers;
+        numa.link_wait += start - now;
+        numa.link_busy += cycles;
+        link_free = start + cycles;
+        return link_free;
+    }
+
+    void read_line(int addr, cacheline_data& line){
+        m_data.read_line((unsigned int)addr, line.words, CACHELINE_WORDS);
+    }
+
+    void write_line(int addr, const cacheline_data& line){
+        m_data.write_line((unsigned int)addr, line.words, CACHELINE_WORDS);
+    }
 
     void snoop(){
         while(true){
-            requests.push(bus->get_next_request());
-            cout << sc_time_stamp() << ": MEMORY snooping PUT REQ into queue " << requests.size() << endl;
-
-            // wait(Port_CLK.default_event());
+            struct request req = bus->get_next_request(controller);
+            if(memory_map.is_numa()){
+                if(remote(req.id)){
+                    ++numa.remote[requestor_cpu(req.id)];
+                    if(req.func != FUNC_READ)
+                        link_transfer(current_cycle()); // written back line comes over the link
+                } else
+                    ++numa.local[requestor_cpu(req.id)];
+            }
+            // written back (or flushed) data goes to the memory array right away, a later
+            // read of the line gets it no matter if it's forwarded from the write queue
+            bool write = req.func == FUNC_WRITE || req.func == FUNC_RESPONSE;
+            if(write)
+                write_line(req.addr, req.data);
+            dram.enqueue(req.id, req.addr, memory_map.local_line(req.addr), req.func, write, current_cycle());
+            cout << sc_time_stamp() << ": MEMORY snooping PUT REQ into queue " << dram.queued() << endl;
+            request_arrived.notify();
         }
     }
+
+    // DRAM controller is clocked only while it has work to do, and sleeps
+    // through the cycles when nothing can finish or be issued
     void execute(){
+        std::vector<dram_request> done;
         while (true)
         {
-            cout << sc_time_stamp() << ": MEM main thread is waiting for requests" << endl;
-
-            while(requests.empty()){
-                cycles_to_wait = 99; // drop to maximum cycles, because of it's fresh memory access
-                // cout << sc_time_stamp() << ": MEM main thread is waiting for requests ONE MORE CYCLE" << endl;
-                bus->memory_controller_wait();
-                // cout << sc_time_stamp() << ": MEM main THINKS that it got request" << endl;
-
+            if(dram.idle() && in_transit.empty()){
+                cout << sc_time_stamp() << ": MEM main thread is waiting for requests" << endl;
+                wait(request_arrived);
+                wait(Port_CLK.default_event());
+            } else if(!config.clocked){
+                // the first edge of the cycle of the next event, new request could come earlier
+                uint64_t now = current_cycle();
+                uint64_t next = dram.next_event(now);
+                if(!in_transit.empty())
+                    next = std::min(next, std::max(now, in_transit.front().done));
+                uint64_t edge = 2 * cycle_offset + sc_time_stamp().value() / (sc_time(CLOCK_PERIOD_NS, SC_NS).value() / 2);
+                if(2 * next >= edge + 2) // posedge of that cycle is not the next edge
+                    wait(sc_time((2 * next - edge - 0.5) * CLOCK_PERIOD_NS / 2.0, SC_NS), request_arrived);
+                wait(Port_CLK.default_event());
+            } else
                 wait(Port_CLK.default_event());
-            }
-            cout << sc_time_stamp() << ": MEM main thread got request" << endl;
-
-            struct request req = requests.front();
-            requests.pop();
-
 
-            Function f = (Memory::Function)req.func;
-            if (f == FUNC_READ)
-            {
-                cout << sc_time_stamp() << ": MEM received read" << endl;
+            uint64_t now = current_cycle();
+            dram.tick(now, done);
+            bool ready = false;
+            for(unsigned int i = 0; i < done.size(); ++i){
+                if(done[i].func == FUNC_RESPONSE)
+                    continue; // flushed line, nobody waits for an acknowledgement
+                if (done[i].func == FUNC_READ)
+                    cout << sc_time_stamp() << ": MEM finished read of " << done[i].addr << endl;
+                else
+                    cout << sc_time_stamp() << ": MEM has finished writing " << done[i].addr << endl;
+                if(remote(done[i].id)){
+                    // the request and the response cross the link, read data waits for its turn on it
+                    done[i].done = (done[i].func == FUNC_READ ? link_transfer(now) : now) + 2 * config.numa_link_latency;
+                    std::list<dram_request>::iterator it = in_transit.end();
+                    while(it != in_transit.begin() && std::prev(it)->done > done[i].done)
+                        --it;
+                    in_transit.insert(it, done[i]);
+                } else {
+                    responses.push(done[i]);
+                    ready = true;
+                }
             }
-            else
-            {
-                cout << sc_time_stamp() << ": MEM received write" << endl;
+            for(; !in_transit.empty() && in_transit.front().done <= now; in_transit.pop_front()){
+                responses.push(in_transit.front());
+                ready = true;
             }
+            if(ready)
+                response_ready.notify();
+            done.clear();
+        }
+    }
 
-            if (f == FUNC_READ){
-                for(int i = 0; i < cycles_to_wait; ++i)wait(Port_CLK.default_event()); // This simulates memory read/write delay                
-                // we trust to the cache module, so we always get aligned address
-                // Port_Data.write( (addr < MEM_SIZE) ? m_data[addr] : 0 );
-                // wait(Port_CLK.default_event());
-                // 8 cycles of actual reading the cacheline
-                // we don't use wider wire here, since it's more interesting :) 
-                cout <<sc_time_stamp() << ": MEM sends read result" << endl;
-                // for(int i = 1; i < 8; ++i){
-                //     Port_Data.write( (addr + i < MEM_SIZE) ? m_data[addr + i] : 0 );
-                //     wait(Port_CLK.default_event());
-                // }
-                // Port_Data.write("ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ");
-                 bus->memory_response(req.id, req.addr);
-            } else {
-                // wait(Port_CLK.default_event()); // one extra cycle to synchronize with CACHE output
-                // for(int i = 0; i < 8; ++i){
-                //     if ((addr + i) < MEM_SIZE)
-                //     {
-                //         m_data[addr + i] = Port_Data.read().to_int();
-                //     }
-                //     wait(Port_CLK.default_event());
-                // }
-                for(int i = 0; i < cycles_to_wait; ++i)wait(Port_CLK.default_event()); // This simulates memory read/write delay                
-                cout << sc_time_stamp() << ": MEM has finished writing" << endl;                
-                // Port_Done.write( RET_WRITE_DONE );
-                bus->memory_response(req.id, req.addr);
-            }
-            cycles_to_wait = 10; // 10 cycles to wait for the next memory load/store if operations are queued
+    void respond(){
+        while(true){
+            while(responses.empty())
+                wait(response_ready);
+            dram_request req = responses.front();
+            responses.pop();
+            responding = true;
+            cout <<sc_time_stamp() << ": MEM sends result" << endl;
+            cacheline_data line;
+            read_line(req.addr, line);
+            bus->memory_response(req.id, req.addr, line);
+            responding = false;
         }
     }
-    private:
-        int cycles_to_wait = 99; // to simulate pipeline in memory
 };
 
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,129 @@
+#ifndef MEMORYMAP_MOD
+#define MEMORYMAP_MOD
+
+#include <stdint.h>
+#include <strings.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdexcept>
+#include "utils.h"
+#include "Checkpoint.h"
+
+// Distribution of the address space over the memory controllers:
+//   LINE - consecutive cachelines go to consecutive controllers
+//   PAGE - consecutive pages (MEM_PAGE_SIZE) go to consecutive controllers
+//   XOR  - like LINE, but higher bits of the line are folded into the choice,
+//          so power of two strides don't hit one controller all the time
+// Every controller sees its own lines as a dense range (local_line), so its
+// DRAM rows and banks are used fully.
+//
+// In the NUMA mode every controller is the local memory of one node, CPUs are
+// split into the nodes in order. Pages are interleaved (PAGE) or placed first
+// touch: a page goes to the node of the CPU which brings it from the memory
+// first and stays there.
+class MemoryMap {
+    public:
+    enum Interleave
+    {
+        INTERLEAVE_LINE,
+        INTERLEAVE_PAGE,
+        INTERLEAVE_XOR,
+        INTERLEAVE_FIRST_TOUCH, // NUMA only
+    };
+
+    MemoryMap(int controllers_ = 1, Interleave interleave_ = INTERLEAVE_LINE, bool numa_ = false, int cpus_ = 1)
+    : controllers(controllers_), interleave(interleave_), numa(numa_), cpus(cpus_), frames(controllers_, 0)
+    {
+        if(controllers < 1)
+            throw std::runtime_error("Error, memory needs at least one controller");
+        if(interleave == INTERLEAVE_XOR && (controllers & (controllers - 1)) != 0)
+            throw std::runtime_error("Error, XOR interleaving needs a power of two controllers");
+        if(interleave == INTERLEAVE_FIRST_TOUCH && !numa)
+            throw std::runtime_error("Error, first touch placement needs NUMA nodes");
+        if(numa && controllers > cpus)
+            throw std::runtime_error("Error, every NUMA node needs at least one CPU");
+    }
+
+    static Interleave interleave_by_name(const char* name){
+        if(strcasecmp(name, "line") == 0) return INTERLEAVE_LINE;
+        if(strcasecmp(name, "page") == 0) return INTERLEAVE_PAGE;
+        if(strcasecmp(name, "xor") == 0) return INTERLEAVE_XOR;
+        throw std::runtime_error(std::string("Error, unknown memory interleaving: ") + name);
+    }
+
+    // cpu is the one which asks for the line, it places a first touch page
+    int controller_of(int addr, int cpu){
+        unsigned int line = (unsigned int)addr / CACHELINE_SIZE;
+        switch(interleave){
+            case INTERLEAVE_PAGE:
+                return ((unsigned int)addr / MEM_PAGE_SIZE) % controllers;
+            case INTERLEAVE_XOR:
+                return (line ^ (line >> 8) ^ (line >> 16)) & (controllers - 1);
+            case INTERLEAVE_FIRST_TOUCH:
+                return place((unsigned int)addr / MEM_PAGE_SIZE, node_of_cpu(cpu)).controller;
+            default:
+                return line % controllers;
+        }
+    }
+
+    // Number of the line among the lines of its controller
+    unsigned int local_line(int addr) const{
+        unsigned int line = (unsigned int)addr / CACHELINE_SIZE;
+        const unsigned int lines_per_page = MEM_PAGE_SIZE / CACHELINE_SIZE;
+        if(interleave == INTERLEAVE_PAGE)
+            return line / lines_per_page / controllers * lines_per_page + line % lines_per_page;
+        if(interleave == INTERLEAVE_FIRST_TOUCH){
+            // pages of a controller get its frames in the order they are placed
+            std::unordered_map<uint32_t, page_t>::const_iterator it = pages.find((unsigned int)addr / MEM_PAGE_SIZE);
+            return (it != pages.end() ? it->second.frame : 0) * lines_per_page + line % lines_per_page;
+        }
+        // the bits which choose the controller are dropped, with XOR the
+        // rest of the line and the controller still tell the line apart
+        return line / controllers;
+    }
+
+    int size() const{ return controllers; }
+    bool is_numa() const{ return numa; }
+
+    // NUMA node of the CPU, the node of a controller is its number
+    int node_of_cpu(int cpu) const{
+        return numa ? cpu * controllers / cpus : 0;
+    }
+
+    // Placement of the first touch pages
+    void checkpoint(Checkpoint& cp){
+        cp.tag("MEMORYMAP");
+        cp.expect((int)interleave, "memory interleaving");
+        std::vector<std::pair<uint32_t, page_t> > placed(pages.begin(), pages.end());
+        cp.io(placed);
+        cp.io(frames);
+        if(!cp.saving)
+            pages = std::unordered_map<uint32_t, page_t>(placed.begin(), placed.end());
+    }
+
+    private:
+    struct page_t {
+        int controller;
+        uint32_t frame;     // page number among the pages of the controller
+    };
+
+    int controllers;
+    Interleave interleave;
+    bool numa;
+    int cpus;
+    std::unordered_map<uint32_t, page_t> pages; // first touch placement
+    std::vector<uint32_t> frames;               // pages placed on every controller
+
+    const page_t& place(uint32_t page, int controller){
+        std::unordered_map<uint32_t, page_t>::iterator it = pages.find(page);
+        if(it != pages.end())
+            return it->second;
+        page_t p = {controller, frames[controller]++};
+        return pages[page] = p;
+    }
+};
+
+extern MemoryMap memory_map;
+
+#endif
@@ -0,0 +1,216 @@
+#ifndef PROTOCOL_MOD
+#define PROTOCOL_MOD
+
+#include <string.h>
+#include <strings.h>
+#include <stdexcept>
+#include <string>
+#include "utils.h"
+
+// Table driven coherence protocol engine.
+// Every protocol is a table indexed by [cacheline state][event] which gives
+// the next state of the line and a set of actions the cache has to perform.
+// Both the cache (processor side and snooping side) and the bus consult the
+// currently selected protocol, so the modules don't know anything about
+// MSI/MESI/MOESI/MESIF/Dragon themselves.
+//
+// Cacheline states are the CACHEL_* values from utils.h. Some protocols
+// reuse them under other names:
+//   MESIF  - CACHEL_FORWARD is the F state
+//   Dragon - CACHEL_SHARED is Sc (shared clean), CACHEL_OWNED is Sm (shared modified)
+// CACHEL_REQUESTED is the transient state of a line which is being brought
+// into the cache and it's handled in the same way by all protocols.
+
+enum ProtocolEvent
+{
+    EV_PR_READ,         // processor reads the line
+    EV_PR_WRITE,        // processor writes the line
+    EV_BUS_READ,        // somebody else reads the line
+    EV_BUS_INVALIDATE,  // somebody else wants to write the line
+    EV_BUS_WRITEBACK,   // somebody else writes the line back to memory
+    EV_BUS_UPDATE,      // somebody else broadcasts new value of the line (Dragon)
+    EV_EVICT,           // line is chosen as a victim
+    EV_COUNT
+};
+
+enum ProtocolAction
+{
+    ACT_NONE       = 0x00,
+    ACT_READ       = 0x01, // line has to be fetched through the bus
+    ACT_INVALIDATE = 0x02, // other copies have to be invalidated before the write
+    ACT_UPDATE     = 0x04, // new value has to be broadcasted to other copies
+    ACT_SUPPLY     = 0x08, // line has to be sent to the requestor (cache-to-cache)
+    ACT_SHARED     = 0x10, // assert the shared line for the requestor
+    ACT_FLUSH      = 0x20, // memory gets updated together with the cache-to-cache transfer
+    ACT_WRITEBACK  = 0x40, // dirty line has to be written back on eviction
+    ACT_STALE      = 0x80, // data which is being fetched is outdated, fetch it again
+};
+
+struct ProtocolTransition
+{
+    int next;
+    int actions;
+};
+
+class Protocol
+{
+  public:
+    const char* name;
+    ProtocolTransition table[CACHEL_STATES][EV_COUNT];
+    int fill_exclusive;         // state of the fetched line if nobody else has it
+    int fill_shared;            // state of the fetched line if the shared line was asserted
+    int update_unshared;        // state after an update which nobody else has seen
+
+    const ProtocolTransition& on(int state, int event) const{
+        return table[state][event];
+    }
+
+    int fill_state(bool shared) const{
+        return shared ? fill_shared : fill_exclusive;
+    }
+
+    static const Protocol* by_name(const char* name);
+};
+
+#define T(next, actions) {next, actions}
+// Row layout:    PR_READ, PR_WRITE, BUS_READ, BUS_INVALIDATE, BUS_WRITEBACK, BUS_UPDATE, EVICT
+#define ROW_INVALID { \
+    T(CACHEL_REQUESTED, ACT_READ), T(CACHEL_REQUESTED, ACT_READ), \
+    T(CACHEL_INVALID, ACT_NONE), T(CACHEL_INVALID, ACT_NONE), T(CACHEL_INVALID, ACT_NONE), \
+    T(CACHEL_INVALID, ACT_NONE), T(CACHEL_INVALID, ACT_NONE) }
+// Somebody who requested the same line before it arrived makes it shared.
+// If somebody writes the line meanwhile, the data we wait for is outdated.
+#define ROW_REQUESTED { \
+    T(CACHEL_REQUESTED, ACT_NONE), T(CACHEL_REQUESTED, ACT_NONE), \
+    T(CACHEL_REQUESTED, ACT_SHARED), T(CACHEL_REQUESTED, ACT_STALE), T(CACHEL_REQUESTED, ACT_NONE), \
+    T(CACHEL_REQUESTED, ACT_STALE), T(CACHEL_INVALID, ACT_NONE) }
+// State which is never used by the protocol
+#define ROW_UNUSED ROW_INVALID
+
+static const Protocol PROTOCOL_MSI = {
+    "MSI",
+    {
+        ROW_INVALID,
+        /* M */ { T(CACHEL_MODIFIED, ACT_NONE), T(CACHEL_MODIFIED, ACT_NONE),
+                  T(CACHEL_SHARED, ACT_SUPPLY | ACT_SHARED | ACT_FLUSH), T(CACHEL_INVALID, ACT_NONE), T(CACHEL_MODIFIED, ACT_NONE),
+                  T(CACHEL_MODIFIED, ACT_NONE), T(CACHEL_INVALID, ACT_WRITEBACK) },
+        /* O */ ROW_UNUSED,
+        /* E */ ROW_UNUSED,
+        /* S */ { T(CACHEL_SHARED, ACT_NONE), T(CACHEL_MODIFIED, ACT_INVALIDATE),
+                  T(CACHEL_SHARED, ACT_SHARED), T(CACHEL_INVALID, ACT_NONE), T(CACHEL_SHARED, ACT_NONE),
+                  T(CACHEL_SHARED, ACT_NONE), T(CACHEL_INVALID, ACT_NONE) },
+        ROW_REQUESTED,
+        /* F */ ROW_UNUSED,
+    },
+    CACHEL_SHARED, CACHEL_SHARED, CACHEL_MODIFIED
+};
+
+static const Protocol PROTOCOL_MESI = {
+    "MESI",
+    {
+        ROW_INVALID,
+        /* M */ { T(CACHEL_MODIFIED, ACT_NONE), T(CACHEL_MODIFIED, ACT_NONE),
+                  T(CACHEL_SHARED, ACT_SUPPLY | ACT_SHARED | ACT_FLUSH), T(CACHEL_INVALID, ACT_NONE), T(CACHEL_MODIFIED, ACT_NONE),
+                  T(CACHEL_MODIFIED, ACT_NONE), T(CACHEL_INVALID, ACT_WRITEBACK) },
+        /* O */ ROW_UNUSED,
+        /* E */ { T(CACHEL_EXCLUSIVE, ACT_NONE), T(CACHEL_MODIFIED, ACT_NONE),
+                  T(CACHEL_SHARED, ACT_SUPPLY | ACT_SHARED), T(CACHEL_INVALID, ACT_NONE), T(CACHEL_EXCLUSIVE, ACT_NONE),
+                  T(CACHEL_EXCLUSIVE, ACT_NONE), T(CACHEL_INVALID, ACT_NONE) },
+        /* S */ { T(CACHEL_SHARED, ACT_NONE), T(CACHEL_MODIFIED, ACT_INVALIDATE),
+                  T(CACHEL_SHARED, ACT_SHARED), T(CACHEL_INVALID, ACT_NONE), T(CACHEL_SHARED, ACT_NONE),
+                  T(CACHEL_SHARED, ACT_NONE), T(CACHEL_INVALID, ACT_NONE) },
+        ROW_REQUESTED,
+        /* F */ ROW_UNUSED,
+    },
+    CACHEL_EXCLUSIVE, CACHEL_SHARED, CACHEL_MODIFIED
+};
+
+// Shared lines are supplied by any sharer, as it was done in the original
+// hand written implementation of the model.
+static const Protocol PROTOCOL_MOESI = {
+    "MOESI",
+    {
+        ROW_INVALID,
+        /* M */ { T(CACHEL_MODIFIED, ACT_NONE), T(CACHEL_MODIFIED, ACT_NONE),
+                  T(CACHEL_OWNED, ACT_SUPPLY | ACT_SHARED), T(CACHEL_INVALID, ACT_NONE), T(CACHEL_MODIFIED, ACT_NONE),
+                  T(CACHEL_MODIFIED, ACT_NONE), T(CACHEL_INVALID, ACT_WRITEBACK) },
+        /* O */ { T(CACHEL_OWNED, ACT_NONE), T(CACHEL_MODIFIED, ACT_INVALIDATE),
+                  T(CACHEL_OWNED, ACT_SUPPLY | ACT_SHARED), T(CACHEL_INVALID, ACT_NONE), T(CACHEL_OWNED, ACT_NONE),
+                  T(CACHEL_OWNED, ACT_NONE), T(CACHEL_INVALID, ACT_WRITEBACK) },
+        /* E */ { T(CACHEL_EXCLUSIVE, ACT_NONE), T(CACHEL_MODIFIED, ACT_NONE),
+                  T(CACHEL_SHARED, ACT_SUPPLY | ACT_SHARED), T(CACHEL_INVALID, ACT_NONE), T(CACHEL_EXCLUSIVE, ACT_NONE),
+                  T(CACHEL_EXCLUSIVE, ACT_NONE), T(CACHEL_INVALID, ACT_NONE) },
+        /* S */ { T(CACHEL_SHARED, ACT_NONE), T(CACHEL_MODIFIED, ACT_INVALIDATE),
+                  T(CACHEL_SHARED, ACT_SUPPLY | ACT_SHARED), T(CACHEL_INVALID, ACT_NONE), T(CACHEL_SHARED, ACT_NONE),
+                  T(CACHEL_SHARED, ACT_NONE), T(CACHEL_INVALID, ACT_NONE) },
+        ROW_REQUESTED,
+        /* F */ ROW_UNUSED,
+    },
+    CACHEL_EXCLUSIVE, CACHEL_SHARED, CACHEL_MODIFIED
+};
+
+// Only the F copy answers reads of a clean shared line,
+// the requestor becomes the new forwarder.
+static const Protocol PROTOCOL_MESIF = {
+    "MESIF",
+    {
+        ROW_INVALID,
+        /* M */ { T(CACHEL_MODIFIED, ACT_NONE), T(CACHEL_MODIFIED, ACT_NONE),
+                  T(CACHEL_SHARED, ACT_SUPPLY | ACT_SHARED | ACT_FLUSH), T(CACHEL_INVALID, ACT_NONE), T(CACHEL_MODIFIED, ACT_NONE),
+                  T(CACHEL_MODIFIED, ACT_NONE), T(CACHEL_INVALID, ACT_WRITEBACK) },
+        /* O */ ROW_UNUSED,
+        /* E */ { T(CACHEL_EXCLUSIVE, ACT_NONE), T(CACHEL_MODIFIED, ACT_NONE),
+                  T(CACHEL_SHARED, ACT_SUPPLY | ACT_SHARED), T(CACHEL_INVALID, ACT_NONE), T(CACHEL_EXCLUSIVE, ACT_NONE),
+                  T(CACHEL_EXCLUSIVE, ACT_NONE), T(CACHEL_INVALID, ACT_NONE) },
+        /* S */ { T(CACHEL_SHARED, ACT_NONE), T(CACHEL_MODIFIED, ACT_INVALIDATE),
+                  T(CACHEL_SHARED, ACT_SHARED), T(CACHEL_INVALID, ACT_NONE), T(CACHEL_SHARED, ACT_NONE),
+                  T(CACHEL_SHARED, ACT_NONE), T(CACHEL_INVALID, ACT_NONE) },
+        ROW_REQUESTED,
+        /* F */ { T(CACHEL_FORWARD, ACT_NONE), T(CACHEL_MODIFIED, ACT_INVALIDATE),
+                  T(CACHEL_SHARED, ACT_SUPPLY | ACT_SHARED), T(CACHEL_INVALID, ACT_NONE), T(CACHEL_FORWARD, ACT_NONE),
+                  T(CACHEL_FORWARD, ACT_NONE), T(CACHEL_INVALID, ACT_NONE) },
+    },
+    CACHEL_EXCLUSIVE, CACHEL_FORWARD, CACHEL_MODIFIED
+};
+
+// Update based protocol: writes to shared lines are broadcasted instead of
+// invalidating other copies, so lines never become invalid because of snoops.
+static const Protocol PROTOCOL_DRAGON = {
+    "Dragon",
+    {
+        ROW_INVALID,
+        /* M  */ { T(CACHEL_MODIFIED, ACT_NONE), T(CACHEL_MODIFIED, ACT_NONE),
+                   T(CACHEL_OWNED, ACT_SUPPLY | ACT_SHARED), T(CACHEL_INVALID, ACT_NONE), T(CACHEL_MODIFIED, ACT_NONE),
+                   T(CACHEL_MODIFIED, ACT_NONE), T(CACHEL_INVALID, ACT_WRITEBACK) },
+        /* Sm */ { T(CACHEL_OWNED, ACT_NONE), T(CACHEL_OWNED, ACT_UPDATE),
+                   T(CACHEL_OWNED, ACT_SUPPLY | ACT_SHARED), T(CACHEL_INVALID, ACT_NONE), T(CACHEL_OWNED, ACT_NONE),
+                   T(CACHEL_SHARED, ACT_SHARED), T(CACHEL_INVALID, ACT_WRITEBACK) },
+        /* E  */ { T(CACHEL_EXCLUSIVE, ACT_NONE), T(CACHEL_MODIFIED, ACT_NONE),
+                   T(CACHEL_SHARED, ACT_SUPPLY | ACT_SHARED), T(CACHEL_INVALID, ACT_NONE), T(CACHEL_EXCLUSIVE, ACT_NONE),
+                   T(CACHEL_SHARED, ACT_SHARED), T(CACHEL_INVALID, ACT_NONE) },
+        /* Sc */ { T(CACHEL_SHARED, ACT_NONE), T(CACHEL_OWNED, ACT_UPDATE),
+                   T(CACHEL_SHARED, ACT_SHARED), T(CACHEL_INVALID, ACT_NONE), T(CACHEL_SHARED, ACT_NONE),
+                   T(CACHEL_SHARED, ACT_SHARED), T(CACHEL_INVALID, ACT_NONE) },
+        ROW_REQUESTED,
+        /* F  */ ROW_UNUSED,
+    },
+    CACHEL_EXCLUSIVE, CACHEL_SHARED, CACHEL_MODIFIED
+};
+
+#undef ROW_UNUSED
+#undef ROW_REQUESTED
+#undef ROW_INVALID
+#undef T
+
+inline const Protocol* Protocol::by_name(const char* name){
+    static const Protocol* all[] = {&PROTOCOL_MSI, &PROTOCOL_MESI, &PROTOCOL_MOESI, &PROTOCOL_MESIF, &PROTOCOL_DRAGON};
+    for(unsigned int i = 0; i < sizeof(all) / sizeof(all[0]); ++i)
+        if(strcasecmp(all[i]->name, name) == 0)
+            return all[i];
+    throw std::runtime_error(std::string("Error, unknown coherence protocol: ") + name);
+}
+
+// Protocol used by all caches and the bus in the simulation
+extern const Protocol* coherence_protocol;
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef SNOOPFILTER_MOD
+#define SNOOPFILTER_MOD
+
+#include <stdint.h>
+#include <string.h>
+#include "utils.h"
+
+// Counting Bloom filter over the cacheline addresses one cache may hold.
+// The cache inserts a line when it starts bringing it in and removes it when
+// the line gets evicted or invalidated, so the filter is always a superset of
+// the valid tags. The bus asks the filter when it puts a request on the wires:
+// if the answer is "definitely not here" the event of the snooping thread isn't
+// notified, so the thread is not woken up at all and the set scan is skipped.
+// False positives only cost a useless wakeup and scan.
+class SnoopFilter {
+    public:
+    SnoopFilter(){
+        memset(counters, 0x0, sizeof(counters));
+        filtered = 0;
+        delivered = 0;
+    }
+
+    void insert(int addr){
+        unsigned int line = line_of(addr);
+        for(int i = 0; i < SNOOP_FILTER_HASHES; ++i)
+            ++counters[hash(line, i)];
+    }
+
+    void remove(int addr){
+        unsigned int line = line_of(addr);
+        for(int i = 0; i < SNOOP_FILTER_HASHES; ++i){
+            // counters are 16 bits wide and a cache has less than 64K lines
+            // (the configuration checks it), so they never saturate and never underflow
+            // as long as every remove() matches an insert()
+            --counters[hash(line, i)];
+        }
+    }
+
+    bool may_contain(int addr) const{
+        unsigned int line = line_of(addr);
+        for(int i = 0; i < SNOOP_FILTER_HASHES; ++i)
+            if(counters[hash(line, i)] == 0)
+                return false;
+        return true;
+    }
+
+    // Called by the bus for every request of other caches.
+    // Returns true if the snoop has to reach the cache.
+    bool pass(int addr){
+        if(may_contain(addr)){
+            ++delivered;
+            return true;
+        }
+        ++filtered;
+        return false;
+    }
+
+    uint64_t filtered;  // snoops suppressed by the filter
+    uint64_t delivered; // snoops which reached the cache (hit or false positive)
+
+    private:
+    uint16_t counters[SNOOP_FILTER_COUNTERS];
+
+    static unsigned int line_of(int addr){
+        return ((unsigned int)addr) >> CACHEINDEX_SHIFT;
+    }
+
+    static unsigned int hash(unsigned int line, int i){
+        // two cheap multiplicative hashes, the second one is derived
+        // from the first (Kirsch-Mitzenmacher double hashing)
+        unsigned int h1 = line * 0x9e3779b1u;
+        unsigned int h2 = (line ^ (line >> 16)) * 0x85ebca6bu | 1;
+        return ((h1 >> 7) + i * (h2 >> 7)) % SNOOP_FILTER_COUNTERS;
+    }
+};
+
+#endif
@@ -0,0 +1,189 @@
+#ifndef SPARSEMEMORY_MOD
+#define SPARSEMEMORY_MOD
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include "utils.h"
+#include "Checkpoint.h"
+
+// Backing store for the whole 32-bit address space. Pages are allocated on
+// the first write only, reads of pages which were never written return zeros
+// without allocating anything, so the footprint follows the touched data and
+// not the size of the address space.
+//
+// Pages are found through a two level radix table: the upper bits of the page
+// number select a leaf table, the lower bits select the page in it. Leaf
+// tables are allocated lazily as well.
+//
+// With use_mmap the whole space is reserved with one MAP_NORESERVE mapping and
+// the kernel gives out zero pages on the first touch, the radix table is not
+// needed then. We still remember which pages were written to report the footprint.
+class SparseMemory {
+    public:
+    explicit SparseMemory(bool use_mmap_ = SPARSE_MEMORY_MMAP)
+    : use_mmap(use_mmap_), base(NULL), pages(0), leaves(0)
+    {
+        memset(directory, 0x0, sizeof(directory));
+        memset(touched_map, 0x0, sizeof(touched_map));
+        if(use_mmap){
+            void* p = mmap(NULL, SPACE_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if(p == MAP_FAILED)
+                use_mmap = false; // no address space for it, fall back to the radix table
+            else
+                base = (int*)p;
+        }
+    }
+
+    ~SparseMemory()
+    {
+        if(base != NULL)
+            munmap(base, SPACE_SIZE);
+        for(int i = 0; i < DIRECTORY_SIZE; ++i){
+            if(directory[i] == NULL) continue;
+            for(int j = 0; j < LEAF_SIZE; ++j)
+                free(directory[i][j]);
+            free(directory[i]);
+        }
+    }
+
+    int read(uint32_t addr) const{
+        if(use_mmap)
+            return touched(addr) ? base[addr / 4] : 0;
+        const int* page = find(addr);
+        return page != NULL ? page[offset(addr)] : 0;
+    }
+
+    void write(uint32_t addr, int value){
+        if(use_mmap){
+            touch(addr);
+            base[addr / 4] = value;
+            return;
+        }
+        allocate(addr)[offset(addr)] = value;
+    }
+
+    // lines never cross a page, so the page is looked up only once
+    void read_line(uint32_t addr, int* words, int count) const{
+        addr &= ~(uint32_t)(count * 4 - 1);
+        const int* page = use_mmap ? (touched(addr) ? base + addr / 4 : NULL) : find(addr);
+        if(page == NULL){
+            memset(words, 0x0, count * sizeof(int));
+            return;
+        }
+        memcpy(words, use_mmap ? page : page + offset(addr), count * sizeof(int));
+    }
+
+    void write_line(uint32_t addr, const int* words, int count){
+        addr &= ~(uint32_t)(count * 4 - 1);
+        int* dst;
+        if(use_mmap){
+            touch(addr);
+            dst = base + addr / 4;
+        } else
+            dst = allocate(addr) + offset(addr);
+        memcpy(dst, words, count * sizeof(int));
+    }
+
+    unsigned long touched_pages() const{ return pages; }
+
+    // bytes of host memory taken by the data and the tables
+    unsigned long footprint() const{
+        unsigned long bytes = pages * (unsigned long)MEM_PAGE_SIZE;
+        if(use_mmap)
+            return bytes + sizeof(touched_map);
+        return bytes + leaves * LEAF_SIZE * sizeof(int*) + sizeof(directory);
+    }
+
+    bool mmapped() const{ return use_mmap; }
+
+    // Only written pages go to the checkpoint, as their number and contents
+    void checkpoint(Checkpoint& cp){
+        uint64_t count = pages;
+        cp.io(count);
+        if(cp.saving){
+            for(uint32_t page = 0; page < (uint32_t)PAGES; ++page){
+                uint32_t addr = page << PAGE_BITS;
+                const int* data = use_mmap ? (touched(addr) ? base + addr / 4 : NULL) : find(addr);
+                if(data == NULL) continue;
+                cp.io(page);
+                cp.io_bytes((void*)data, MEM_PAGE_SIZE);
+            }
+            return;
+        }
+        for(uint64_t i = 0; i < count; ++i){
+            uint32_t page;
+            cp.io(page);
+            uint32_t addr = page << PAGE_BITS;
+            int* data;
+            if(use_mmap){
+                touch(addr);
+                data = base + addr / 4;
+            } else
+                data = allocate(addr);
+            cp.io_bytes(data, MEM_PAGE_SIZE);
+        }
+    }
+
+    private:
+    static const int PAGE_BITS = 12; // log2(MEM_PAGE_SIZE)
+    static const int LEAF_BITS = 10;
+    static const int DIRECTORY_BITS = 32 - PAGE_BITS - LEAF_BITS;
+    static const int LEAF_SIZE = 1 << LEAF_BITS;
+    static const int DIRECTORY_SIZE = 1 << DIRECTORY_BITS;
+    static const size_t SPACE_SIZE = (size_t)1 << 32;
+    static const int PAGES = 1 << (32 - PAGE_BITS);
+
+    bool use_mmap;
+    int* base;                          // the mmap reservation
+    int** directory[DIRECTORY_SIZE];    // leaf tables of page pointers
+    uint64_t touched_map[PAGES / 64];   // written pages of the mmap reservation
+    unsigned long pages;
+    unsigned long leaves;
+
+    static unsigned int offset(uint32_t addr){
+        return (addr & (MEM_PAGE_SIZE - 1)) / 4;
+    }
+
+    const int* find(uint32_t addr) const{
+        int** leaf = directory[addr >> (PAGE_BITS + LEAF_BITS)];
+        if(leaf == NULL) return NULL;
+        return leaf[(addr >> PAGE_BITS) & (LEAF_SIZE - 1)];
+    }
+
+    int* allocate(uint32_t addr){
+        int**& leaf = directory[addr >> (PAGE_BITS + LEAF_BITS)];
+        if(leaf == NULL){
+            leaf = (int**)calloc(LEAF_SIZE, sizeof(int*));
+            if(leaf == NULL)
+                throw std::runtime_error("Error, unable to allocate memory page table");
+            ++leaves;
+        }
+        int*& page = leaf[(addr >> PAGE_BITS) & (LEAF_SIZE - 1)];
+        if(page == NULL){
+            page = (int*)calloc(MEM_PAGE_SIZE, 1); // zero initialized, the checker expects it
+            if(page == NULL)
+                throw std::runtime_error("Error, unable to allocate memory page");
+            ++pages;
+        }
+        return page;
+    }
+
+    bool touched(uint32_t addr) const{
+        uint32_t page = addr >> PAGE_BITS;
+        return (touched_map[page / 64] >> (page % 64)) & 1;
+    }
+
+    void touch(uint32_t addr){
+        uint32_t page = addr >> PAGE_BITS;
+        if(!touched(addr)){
+            touched_map[page / 64] |= (uint64_t)1 << (page % 64);
+            ++pages;
+        }
+    }
+};
+
+#endif
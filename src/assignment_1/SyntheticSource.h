@@ -0,0 +1,227 @@
+#ifndef SYNTHETICSOURCE_MOD
+#define SYNTHETICSOURCE_MOD
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <stdexcept>
+#include "TraceSource.h"
+
+// Trace source which makes the accesses up instead of reading a trace file,
+// so runs could be as long as we want and a pattern could stress one
+// coherence behaviour. It's configured with a string like
+//   zipf:length=1000000,footprint=262144,reads=70,share=20,degree=4,alpha=0.9
+// Patterns:
+//   stride    - every region is walked with the stride
+//   random    - uniformly random lines
+//   zipf      - lines with Zipf distributed popularity (alpha)
+//   prodcons  - first CPU of every sharing group writes a buffer in order,
+//               the others read it in the same order
+//   migratory - every line of the shared region is read and then written by
+//               one CPU after another, so it moves from cache to cache
+// Keys:
+//   length    - memory accesses per CPU
+//   footprint - bytes of every private and every shared region
+//   reads     - percent of reads (stride, random, zipf)
+//   share     - percent of accesses which go to the shared region (stride, random, zipf)
+//   degree    - CPUs which share one shared region, all of them by default
+//   stride    - bytes between accesses of the stride pattern
+//   alpha     - skew of the Zipf distribution
+//   nops      - NOPs after every access
+//   seed      - of the random generators, every CPU has its own one
+// The entries of every CPU only depend on the configuration and the CPU, not on
+// the order in which CPUs take them, so a run (and its checkpoint) repeats exactly.
+class SyntheticTraceSource : public TraceSource {
+    public:
+    enum Pattern
+    {
+        PATTERN_STRIDE,
+        PATTERN_RANDOM,
+        PATTERN_ZIPF,
+        PATTERN_PRODCONS,
+        PATTERN_MIGRATORY,
+    };
+
+    SyntheticTraceSource(const char* spec, uint32_t cpus_)
+    : pattern(PATTERN_RANDOM), length(1000000), footprint(256 * 1024), reads(70), share(0),
+      degree(cpus_), stride(CACHELINE_SIZE), alpha(0.9), nops(0), seed(1), ended(0)
+    {
+        parse(spec);
+        if(length < 1 || footprint < CACHELINE_SIZE || reads > 100 || share > 100 || degree < 1 || stride < 4)
+            throw std::runtime_error(std::string("Error, invalid synthetic workload ") + spec);
+        // all regions have to fit into the 32-bit space
+        uint64_t groups = (cpus_ + degree - 1) / degree;
+        if(PRIVATE_BASE + cpus_ * footprint > SHARED_BASE || SHARED_BASE + groups * footprint > 0x100000000ULL)
+            throw std::runtime_error(std::string("Error, footprint of synthetic workload is too big: ") + spec);
+        lines = footprint / CACHELINE_SIZE;
+        if(pattern == PATTERN_ZIPF){
+            // cumulative popularity of the lines, the first one is the hottest
+            zipf_cdf.resize(lines);
+            double sum = 0;
+            for(uint64_t i = 0; i < lines; ++i)
+                zipf_cdf[i] = (sum += 1.0 / pow((double)(i + 1), alpha));
+            for(uint64_t i = 0; i < lines; ++i)
+                zipf_cdf[i] /= sum;
+        }
+        for(uint32_t i = 0; i < cpus_; ++i)
+            states.push_back(state_t(seed * 1000003 + i));
+    }
+
+    virtual bool next(uint32_t pid, TraceFile::Entry& e){
+        if(pid >= states.size())
+            return false;
+        state_t& s = states[pid];
+        e.addr = 0;
+        e.type = TraceFile::ENTRY_TYPE_NOP;
+        if(s.ended)
+            return true;
+        if(s.gap > 0)
+            --s.gap;
+        else if(s.migrating){
+            // the write of the read-modify-write, to the same word
+            e.type = TraceFile::ENTRY_TYPE_WRITE;
+            e.addr = s.last;
+            s.migrating = false;
+            s.gap = nops;
+        } else {
+            generate(pid, s, e);
+            ++s.accesses;
+            s.migrating = pattern == PATTERN_MIGRATORY;
+            if(!s.migrating)
+                s.gap = nops;
+        }
+        if(s.accesses == length && s.gap == 0 && !s.migrating){
+            s.ended = true; // this was the last entry
+            ++ended;
+        }
+        return true;
+    }
+
+    virtual bool finished(uint32_t pid) const{
+        return pid >= states.size() || states[pid].ended;
+    }
+
+    virtual bool eof() const{
+        return ended == states.size();
+    }
+
+    private:
+    // Regions are apart, so they never share a cacheline
+    static const uint32_t PRIVATE_BASE = 0x10000000;
+    static const uint32_t SHARED_BASE = 0x80000000;
+
+    struct state_t {
+        std::mt19937 rng;
+        uint64_t accesses;   // generated so far
+        uint64_t gap;        // NOPs before the next access
+        uint64_t position;   // of the stride and producer-consumer walks
+        uint32_t last;       // address of the last access
+        bool migrating;      // the write of the last read is still to come
+        bool ended;
+        explicit state_t(uint32_t seed_)
+        : rng(seed_), accesses(0), gap(0), position(0), last(0), migrating(false), ended(false) {}
+    };
+
+    Pattern pattern;
+    uint64_t length;
+    uint64_t footprint;
+    unsigned int reads;
+    unsigned int share;
+    unsigned int degree;
+    uint64_t stride;
+    double alpha;
+    uint64_t nops;
+    uint32_t seed;
+    uint64_t lines;
+    std::vector<double> zipf_cdf;
+    std::vector<state_t> states;
+    size_t ended;
+
+    void parse(const char* spec){
+        std::string s(spec);
+        std::string name = s.substr(0, s.find(':'));
+        if(name == "stride") pattern = PATTERN_STRIDE;
+        else if(name == "random") pattern = PATTERN_RANDOM;
+        else if(name == "zipf") pattern = PATTERN_ZIPF;
+        else if(name == "prodcons") pattern = PATTERN_PRODCONS;
+        else if(name == "migratory") pattern = PATTERN_MIGRATORY;
+        else throw std::runtime_error("Error, unknown synthetic pattern: " + name);
+        size_t pos = s.find(':');
+        while(pos != std::string::npos){
+            size_t end = s.find(',', pos + 1);
+            std::string option = s.substr(pos + 1, end == std::string::npos ? std::string::npos : end - pos - 1);
+            pos = end;
+            size_t eq = option.find('=');
+            if(eq == std::string::npos)
+                throw std::runtime_error("Error, synthetic option without a value: " + option);
+            std::string key = option.substr(0, eq);
+            const char* value = option.c_str() + eq + 1;
+            if(key == "length") length = strtoull(value, NULL, 10);
+            else if(key == "footprint") footprint = strtoull(value, NULL, 10);
+            else if(key == "reads") reads = atoi(value);
+            else if(key == "share") share = atoi(value);
+            else if(key == "degree") degree = atoi(value);
+            else if(key == "stride") stride = strtoull(value, NULL, 10);
+            else if(key == "alpha") alpha = atof(value);
+            else if(key == "nops") nops = strtoull(value, NULL, 10);
+            else if(key == "seed") seed = atoi(value);
+            else throw std::runtime_error("Error, unknown synthetic option: " + key);
+        }
+    }
+
+    uint32_t private_region(uint32_t pid) const{
+        return PRIVATE_BASE + pid * footprint;
+    }
+
+    uint32_t shared_region(uint32_t pid) const{
+        return SHARED_BASE + (pid / degree) * footprint;
+    }
+
+    uint64_t zipf_line(std::mt19937& rng) const{
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        return std::lower_bound(zipf_cdf.begin(), zipf_cdf.end(), u) - zipf_cdf.begin();
+    }
+
+    void generate(uint32_t pid, state_t& s, TraceFile::Entry& e){
+        std::uniform_int_distribution<unsigned int> percent(0, 99);
+        uint64_t offset;
+        bool write;
+        uint32_t base;
+        unsigned int member = pid % degree;
+        switch(pattern){
+            case PATTERN_PRODCONS:
+                // the producer and the consumers walk the same buffer word by word
+                base = shared_region(pid);
+                offset = (s.position++ * 4) % footprint;
+                write = member == 0;
+                break;
+            case PATTERN_MIGRATORY:
+                // CPUs of the group start in different parts of the region,
+                // a line gets to the next CPU after lines / degree accesses
+                base = shared_region(pid);
+                offset = ((s.position++ + member * lines / degree) % lines) * CACHELINE_SIZE;
+                write = false;
+                break;
+            default:
+                base = percent(s.rng) < share ? shared_region(pid) : private_region(pid);
+                write = percent(s.rng) >= reads;
+                if(pattern == PATTERN_STRIDE)
+                    offset = (s.position++ * stride) % footprint;
+                else {
+                    uint64_t line = pattern == PATTERN_ZIPF ? zipf_line(s.rng)
+                                  : std::uniform_int_distribution<uint64_t>(0, lines - 1)(s.rng);
+                    offset = line * CACHELINE_SIZE + std::uniform_int_distribution<int>(0, CACHELINE_WORDS - 1)(s.rng) * 4;
+                }
+                break;
+        }
+        e.type = write ? TraceFile::ENTRY_TYPE_WRITE : TraceFile::ENTRY_TYPE_READ;
+        e.addr = s.last = base + (uint32_t)(offset & ~(uint64_t)3);
+    }
+};
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef TRACESOURCE_MOD
+#define TRACESOURCE_MOD
+
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "psa.h"
+#include "utils.h"
+
+// Where CPUs get their trace entries from. Semantics are the ones of
+// TraceFile: after the end of its trace a CPU gets NOPs, finished() tells
+// if the CPU has taken the end of its trace and eof() if all of them have.
+class TraceSource {
+    public:
+    virtual ~TraceSource(){}
+    virtual bool next(uint32_t pid, TraceFile::Entry& e) = 0;
+    virtual bool finished(uint32_t pid) const = 0;
+    virtual bool eof() const = 0;
+};
+
+// Reads the trace file directly in the simulation thread
+class TraceFileSource : public TraceSource {
+    public:
+    explicit TraceFileSource(TraceFile* file_) : file(file_) {}
+
+    virtual bool next(uint32_t pid, TraceFile::Entry& e){ return file->next(pid, e); }
+    virtual bool finished(uint32_t pid) const{ return file->finished(pid); }
+    virtual bool eof() const{ return file->eof(); }
+
+    private:
+    TraceFile* file;
+};
+
+// Every CPU trace is read and decoded by its own host thread with its own
+// file handle, ahead of the simulation. Entries are handed over in chunks, so
+// the simulation thread only takes a lock once per TRACE_CHUNK entries and
+// never waits for the disk as long as the readers keep up. Readers stay at
+// most TRACE_CHUNKS_AHEAD chunks ahead, so memory doesn't grow with the trace.
+class PrefetchingTraceSource : public TraceSource {
+    public:
+    PrefetchingTraceSource(const char* filename, uint32_t cpus)
+    : readers(cpus), ended(0)
+    {
+        for(uint32_t i = 0; i < cpus; ++i){
+            readers[i] = new reader_t();
+            readers[i]->thread = std::thread(&PrefetchingTraceSource::prefetch, this, filename, i);
+        }
+    }
+
+    ~PrefetchingTraceSource()
+    {
+        for(unsigned int i = 0; i < readers.size(); ++i){
+            {
+                std::lock_guard<std::mutex> lock(readers[i]->mutex);
+                readers[i]->stop = true;
+            }
+            readers[i]->space.notify_all();
+            readers[i]->thread.join();
+            delete readers[i];
+        }
+    }
+
+    virtual bool next(uint32_t pid, TraceFile::Entry& e){
+        if(pid >= readers.size())
+            return false;
+        reader_t& r = *readers[pid];
+        if(r.ended){
+            e.addr = 0;
+            e.type = TraceFile::ENTRY_TYPE_NOP;
+            return true;
+        }
+        if(r.index == r.current.entries.size()){
+            std::unique_lock<std::mutex> lock(r.mutex);
+            r.filled.wait(lock, [&r]{ return !r.chunks.empty(); });
+            r.current = std::move(r.chunks.front());
+            r.chunks.pop_front();
+            lock.unlock();
+            r.space.notify_one();
+            r.index = 0;
+            if(r.current.error)
+                return false;
+        }
+        e = r.current.entries[r.index++];
+        if(r.current.last && r.index == r.current.entries.size()){
+            r.ended = true; // this was the end of the trace
+            ++ended;
+        }
+        return true;
+    }
+
+    virtual bool finished(uint32_t pid) const{
+        return pid >= readers.size() || readers[pid]->ended;
+    }
+
+    virtual bool eof() const{
+        return ended == readers.size();
+    }
+
+    private:
+    struct chunk_t {
+        std::vector<TraceFile::Entry> entries;
+        bool last;   // ends with the end of the trace
+        bool error;  // the trace couldn't be read
+        chunk_t() : last(false), error(false) {}
+    };
+
+    struct reader_t {
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable filled;
+        std::condition_variable space;
+        std::deque<chunk_t> chunks;
+        bool stop;
+        // owned by the simulation thread
+        chunk_t current;
+        size_t index;
+        bool ended;
+        reader_t() : stop(false), index(0), ended(false) {}
+    };
+
+    std::vector<reader_t*> readers;
+    size_t ended;
+
+    void prefetch(const char* filename, uint32_t pid){
+        reader_t& r = *readers[pid];
+        TraceFile* file = NULL;
+        bool done = false;
+        while(!done){
+            chunk_t chunk;
+            try {
+                if(file == NULL)
+                    file = new TraceFile(filename);
+                chunk.entries.reserve(TRACE_CHUNK);
+                while(chunk.entries.size() < (size_t)TRACE_CHUNK && !done){
+                    TraceFile::Entry e;
+                    if(!file->next(pid, e)){
+                        chunk.error = true;
+                        done = true;
+                        break;
+                    }
+                    chunk.entries.push_back(e);
+                    done = chunk.last = file->finished(pid);
+                }
+            } catch(std::exception&){
+                chunk.error = true;
+                done = true;
+            }
+            std::unique_lock<std::mutex> lock(r.mutex);
+            r.space.wait(lock, [&r]{ return r.stop || r.chunks.size() < (size_t)TRACE_CHUNKS_AHEAD; });
+            if(r.stop)
+                break;
+            r.chunks.push_back(std::move(chunk));
+            lock.unlock();
+            r.filled.notify_one();
+        }
+        delete file;
+    }
+};
+
+// The source CPUs read from
+extern TraceSource* trace_source;
+
+#endif
@@ -21,6 +21,15 @@
 #include "Memory.h"
 #include "Cache.h"
 #include "Bus.h"
+#include "Interconnect.h"
+#include "Protocol.h"
+#include "Checker.h"
+#include "TraceSource.h"
+#include "SyntheticSource.h"
+#include "Checkpoint.h"
+#include "Config.h"
+#include "Arena.h"
+#include "MemoryMap.h"
 #include "utils.h"
 
 
@@ -28,37 +37,185 @@ using namespace std;
 using namespace sc_core; // This pollutes namespace, better: only import what you need.
 
 std::atomic<unsigned int> _main_memory_access_rate;
-std::atomic<unsigned int > _time_for_bus_acquisition;
+const Protocol* coherence_protocol = &PROTOCOL_MOESI;
+bool functional_mode = false;
+CoherenceChecker* golden_memory = NULL;
+TraceSource* trace_source = NULL;
+uint64_t cycle_offset = 0;
+Config config;
+MemoryMap memory_map;
+
+static void print_latency(unsigned int cpu, const char* name, const LatencyHistogram& h){
+    printf("%u\t%s\t%lu\t%f\t%lu\t%lu\t%lu\t%lu\n", cpu, name, (unsigned long)h.count, h.mean(),
+           (unsigned long)h.percentile(0.5), (unsigned long)h.percentile(0.99),
+           (unsigned long)h.percentile(0.999), (unsigned long)h.max_value);
+}
+
+// Saves or restores everything which has state. The restored model continues
+// at the first full cycle after the checkpoint, so the absolute cycles kept by
+// the modules stay valid. Returns the cycle of the checkpoint.
+static uint64_t checkpoint_model(Checkpoint& cp, std::vector<CPU*>& cpus, std::vector<SingleCache*>& caches,
+                                 std::vector<Memory*>& mems, Interconnect& bus)
+{
+    cp.tag("MODEL");
+    cp.expect((int)cpus.size(), "number of CPUs");
+    cp.expect(coherence_protocol->name, "protocol");
+    cp.expect(functional_mode, "functional mode");
+    uint64_t period = sc_time(CLOCK_PERIOD_NS, SC_NS).value();
+    uint64_t cycle = cycle_offset + (sc_time_stamp().value() + period - 1) / period;
+    cp.io(cycle);
+    if(!cp.saving)
+        cycle_offset = cycle;
+    unsigned int accesses = _main_memory_access_rate.load();
+    cp.io(accesses);
+    _main_memory_access_rate.store(accesses);
+    for(unsigned int i = 0; i < cpus.size(); ++i){
+        int counters[4] = {stats_readhits(i), stats_readmisses(i), stats_writehits(i), stats_writemisses(i)};
+        cp.io(counters);
+        stats_set(i, counters[0], counters[1], counters[2], counters[3]);
+        cpus[i]->checkpoint(cp);
+        caches[i]->checkpoint(cp);
+    }
+    cp.expect((int)mems.size(), "number of memory controllers");
+    memory_map.checkpoint(cp);
+    for(unsigned int i = 0; i < mems.size(); ++i)
+        mems[i]->checkpoint(cp);
+    bus.checkpoint(cp);
+    if(golden_memory != NULL)
+        golden_memory->checkpoint(cp);
+    return cycle;
+}
+
 int sc_main(int argc, char* argv[])
 {
     timespec time1, time2;
     try
     {
-        // Get the tracefile argument and create Tracefile object
-        // This function sets tracefile_ptr and num_cpus
-        init_tracefile(&argc, &argv);
-        int CPUNUM = atoi(argv[0]);
+        // Options start with "--" and could be anywhere, the rest of arguments are positional:
+        // <tracefile> [cpus] [protocol] [topology], or [cpus] [protocol] [topology] for a
+        // synthetic workload. Every key of the configuration is an option as well,
+        // the configuration file is read first, so the command line overrides it.
+        for(int i = 1; i < argc; ++i)
+            if(strncmp(argv[i], "--config=", 9) == 0)
+                config.load(argv[i] + 9);
+        std::vector<const char*> positional;
+        bool print_config = false;
+        for(int i = 1; i < argc; ++i){
+            if(strncmp(argv[i], "--config=", 9) == 0)
+                continue;
+            else if(strcmp(argv[i], "--print-config") == 0)
+                print_config = true;
+            else if(strcmp(argv[i], "--functional") == 0)
+                config.functional = true;
+            else if(strcmp(argv[i], "--clocked") == 0)
+                config.clocked = true;
+            else if(strcmp(argv[i], "--no-prefetch") == 0)
+                config.prefetch = false;
+            else if(strcmp(argv[i], "--lt") == 0)
+                config.lt = true;
+            else if(strcmp(argv[i], "--ooo") == 0)
+                config.rob = OOO_ROB_SIZE;
+            else if(strncmp(argv[i], "--", 2) == 0){
+                char* eq = strchr(argv[i], '=');
+                if(eq == NULL || !config.set(string(argv[i] + 2, eq), eq + 1))
+                    throw runtime_error(string("Error, unknown option ") + argv[i]);
+            } else
+                positional.push_back(argv[i]);
+        }
+        unsigned int next = 0;
+        if(config.synthetic.empty() && next < positional.size())
+            config.trace = positional[next++];
+        if(next < positional.size())
+            config.cpus = atoi(positional[next++]);
+        if(next < positional.size())
+            config.protocol = positional[next++];
+        if(next < positional.size())
+            config.topology = positional[next++];
+        if(next < positional.size())
+            throw runtime_error(string("Error, unexpected argument ") + positional[next]);
+        config.validate();
+        if(print_config){
+            config.print(stdout);
+            return 0;
+        }
+
+        functional_mode = config.functional;
+        if(functional_mode)
+            golden_memory = new CoherenceChecker();
+        if(!config.synthetic.empty()){
+            // no trace file, the workload has as many processors as we ask for
+            if(config.cpus < 1)
+                throw runtime_error(string("Error, usage: ") + argv[0] + " --synthetic=<workload> <cpus>");
+            num_cpus = config.cpus;
+            trace_source = new SyntheticTraceSource(config.synthetic.c_str(), num_cpus);
+        } else {
+            if(config.trace.empty())
+                throw runtime_error(string("Error, usage: ") + argv[0] + " <tracefile> [cpus] [protocol] [topology] [--config=FILE]");
+            // sets tracefile_ptr and num_cpus like init_tracefile
+            tracefile_ptr = new TraceFile(config.trace.c_str());
+            num_cpus = tracefile_ptr->get_proc_count();
+            if(config.prefetch)
+                trace_source = new PrefetchingTraceSource(config.trace.c_str(), num_cpus);
+            else
+                trace_source = new TraceFileSource(tracefile_ptr);
+        }
+        // every processor of the trace needs its CPU and there is nothing for an extra one,
+        // the run would be cut short or would never end
+        if(config.cpus != 0 && config.cpus != (int)num_cpus)
+            throw runtime_error("Error, the trace has " + to_string(num_cpus) + " processors, not " +
+                                to_string(config.cpus));
+        int CPUNUM = num_cpus;
+        if(CPUNUM > MAX_CPUS)
+            throw runtime_error("Error, too many CPUs");
+        coherence_protocol = Protocol::by_name(config.protocol.c_str());
+        // The topology is bus, multibus[:N], ring[:N] or mesh[:N], where N is the
+        // number of address interleaved segments (one per CPU by default)
+        std::string topology_name = config.topology.substr(0, config.topology.find(':'));
+        Interconnect::Topology topology = Interconnect::topology_by_name(topology_name.c_str());
+        int segments = 1;
+        if(topology != Interconnect::TOPOLOGY_BUS)
+            segments = topology_name.size() < config.topology.size() ?
+                       atoi(config.topology.c_str() + topology_name.size() + 1) : CPUNUM;
+        // NUMA nodes have one memory controller each, their pages are placed first
+        // touch or interleaved page by page
+        if(config.numa_nodes > 0)
+            memory_map = MemoryMap(config.numa_nodes, config.numa_placement == "first-touch" ?
+                                   MemoryMap::INTERLEAVE_FIRST_TOUCH : MemoryMap::INTERLEAVE_PAGE, true, CPUNUM);
+        else
+            memory_map = MemoryMap(config.memory_controllers,
+                                   MemoryMap::interleave_by_name(config.memory_interleave.c_str()));
         _main_memory_access_rate.store(0);
-        _time_for_bus_acquisition.store(0);
         // Initialize statistics counters
         stats_init();
         sc_report_handler::set_actions (SC_ID_VECTOR_CONTAINS_LOGIC_VALUE_,
                                 SC_DO_NOTHING);
-        Bus bus("bus");
-        sc_clock clk;
-        Memory* mem =  new Memory{"main_memory"};
-        mem->bus(bus);
+        Interconnect bus("bus", topology, segments, CPUNUM, config.link_latency,
+                         std::max(1, CACHELINE_SIZE / config.link_bytes));
+        sc_clock clk("clk", CLOCK_PERIOD_NS, SC_NS);
+        // modules and signals of the cores live in the arena, it's destroyed first
+        Arena arena;
+        std::vector<Memory*> mems;
+        for(int i = 0; i < memory_map.size(); ++i){
+            Memory* mem = arena.create<Memory>("main_memory", i);
+            mem->bus(bus);
+            mem->Port_CLK(clk);
+            mems.push_back(mem);
+        }
+        std::vector<SingleCache*> caches;
+        std::vector<CPU*> cpus;
         for(int i = 0; i < CPUNUM; ++i){
              // Instantiate Modules
-            CPU*    cpu =  new CPU{"cpu", i};
-            SingleCache* cache = new SingleCache{"cache"};
+            CPU*    cpu = arena.create<CPU>("cpu", i);
+            SingleCache* cache = arena.create<SingleCache>("cache");
             cache->id = i;
+            caches.push_back(cache);
+            cpus.push_back(cpu);
 
             // Signals CPU_TO_CACHE
-            sc_buffer<Memory::Function> *sigCacheFunc = new sc_buffer<Memory::Function>;
-            sc_buffer<Memory::RetCode>  *sigCacheDone = new sc_buffer<Memory::RetCode>;
-            sc_signal<int>              *sigCacheAddr = new sc_signal<int>;
-            // sc_signal_rv<32>            sigCacheData;
+            sc_buffer<Memory::Function> *sigCacheFunc = arena.create<sc_buffer<Memory::Function> >();
+            sc_buffer<Memory::RetCode>  *sigCacheDone = arena.create<sc_buffer<Memory::RetCode> >();
+            sc_signal<int>              *sigCacheAddr = arena.create<sc_signal<int> >();
+            sc_signal_rv<32>            *sigCacheData = arena.create<sc_signal_rv<32> >();
 
             // Signals CACHE_TO_MEM
             // sc_buffer<Memory::Function> sigMemFunc;
@@ -80,33 +237,146 @@ int sc_main(int argc, char* argv[])
             
             cache->Port_Func(*sigCacheFunc);
             cache->Port_Addr(*sigCacheAddr);
-            // cache.Port_Data(sigCacheData);
+            cache->Port_Data(*sigCacheData);
             cache->Port_Done(*sigCacheDone);
 
             cpu->Port_MemFunc(*sigCacheFunc);
             cpu->Port_MemAddr(*sigCacheAddr);
-            // cpu.Port_MemData(sigCacheData);
+            cpu->Port_MemData(*sigCacheData);
             cpu->Port_MemDone(*sigCacheDone);
+            cpu->Port_Cache(*cache);
 
             cpu->Port_CLK(clk);
             cache->Port_CLK(clk);
 
         }
-            mem->Port_CLK(clk);
             bus.Port_CLK(clk);
+
+        if(!config.restore.empty()){
+            Checkpoint cp(config.restore.c_str(), false);
+            checkpoint_model(cp, cpus, caches, mems, bus);
+            cout << "Restored " << config.restore << " at cycle " << cycle_offset << endl;
+        }
        
-        cout << "Running (press CTRL+C to interrupt)... " << endl;
+        cout << "Running " << coherence_protocol->name << (functional_mode ? " in functional mode" : "") << " (press CTRL+C to interrupt)... " << endl;
+        cout << "Caches: " << config.cache_sets << " sets, " << config.cache_ways << " ways ("
+             << config.cache_sets * config.cache_ways * CACHELINE_SIZE / 1024 << " KB)" << endl;
+        if(config.rob > 0)
+            cout << "Out-of-order core: window " << config.rob << ", LSQ " << config.lsq
+                 << ", width " << config.issue_width << endl;
         // Start Simulation
         clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time1);
         sc_start();
+        if(!config.checkpoint.empty()){
+            if(CPU::parked_cpus() == 0)
+                cout << "Traces ended before cycle " << config.checkpoint_at << ", no checkpoint written" << endl;
+            else {
+                Checkpoint cp(config.checkpoint.c_str(), true);
+                uint64_t cycle = checkpoint_model(cp, cpus, caches, mems, bus);
+                cout << "Checkpoint of cycle " << cycle << " written to " << config.checkpoint << endl;
+            }
+        }
+        delete trace_source; // stops the trace readers
+        trace_source = NULL;
         clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time2);
         unsigned int result = (time2.tv_sec - time1.tv_sec) * 1e6 + (time2.tv_nsec - time1.tv_nsec) / 1e3;
 
         // Print statistics after simulation finished
         stats_print();
+        for(unsigned int i = 0; i < mems.size(); ++i)
+            mems[i]->print_stats();
+        // bandwidth in bytes per cycle, occupancy is the average of queued requests
+        printf("MC\tRequests\tReads\tWrites\tBandwidth\tAvgOcc\tAvgLatency\tRowHit%%\n");
+        for(unsigned int i = 0; i < mems.size(); ++i)
+            mems[i]->print_summary(current_cycle());
+        if(memory_map.is_numa()){
+            printf("CPU\tNode\tLocal\tRemote\tRemote%%\n");
+            for(int i = 0; i < CPUNUM; ++i){
+                uint64_t local = 0, remote = 0;
+                for(unsigned int m = 0; m < mems.size(); ++m){
+                    local += mems[m]->numa.local[i];
+                    remote += mems[m]->numa.remote[i];
+                }
+                printf("%d\t%d\t%lu\t%lu\t%f\n", i, memory_map.node_of_cpu(i), (unsigned long)local,
+                       (unsigned long)remote, local + remote ? 100.0 * remote / (local + remote) : 0.0);
+            }
+            // link busy in percent of the run, wait in cycles per line
+            printf("Node\tLocal\tRemote\tRemote%%\tLinkBusy%%\tAvgLinkWait\n");
+            for(unsigned int i = 0; i < mems.size(); ++i)
+                mems[i]->print_numa(current_cycle());
+        }
         printf("Main memory access rate = %u\n", _main_memory_access_rate.load());
-        printf("Average time for bus acquisition %u ms\n", _time_for_bus_acquisition.load() / _main_memory_access_rate.load());
         printf("Total execution time %u ms\n", result);
+        printf("Protocol %s, simulated time %s\n", coherence_protocol->name, sc_time_stamp().to_string().c_str());
+        // cycle totals have to be the same for both kinds of timing
+        printf("Simulated cycles %lu (%s timing)\n", (unsigned long)current_cycle(),
+               config.clocked ? "clocked" : "event driven");
+        printf("Bus\tReads\tWBacks\tInvals\tUpdates\tC2C\tMemResp\n");
+        bus_traffic_t traffic = bus.get_traffic();
+        printf("\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\n", traffic.reads, traffic.writebacks,
+               traffic.invalidates, traffic.updates, traffic.c2c, traffic.responses);
+        // cycles every segment was held by every kind of transaction, bytes of
+        // cachelines moved and requestors which lost the arbitration per cycle
+        printf("Seg\tBusy%%\tRead\tWBack\tInval\tUpdate\tC2C\tMemResp\tBytes\tB/cycle\tAvgWaiting\tMaxWaiting\n");
+        bus.print_usage(current_cycle());
+        if(!config.bus_csv.empty()){
+            FILE* f = fopen(config.bus_csv.c_str(), "w");
+            if(f == NULL)
+                throw runtime_error("Error, unable to write " + config.bus_csv);
+            fprintf(f, "segment,cycle");
+            for(int t = 0; t < BUS_TX_COUNT; ++t)
+                fprintf(f, ",%s", BUS_TX_NAMES[t]);
+            fprintf(f, ",bytes,avg_waiting,max_waiting\n");
+            bus.print_usage_csv(f);
+            fclose(f);
+        }
+        // latencies in cycles, percentiles are exact up to 1/16 of the value
+        printf("CPU\tLatency\tCount\tAvg\tp50\tp99\tp999\tMax\n");
+        for(unsigned int i = 0; i < caches.size(); ++i){
+            print_latency(i, "BusWait", caches[i]->bus_wait);
+            for(int o = 0; o < OUTCOME_COUNT; ++o)
+                print_latency(i, OUTCOME_NAMES[o], caches[i]->latency[o]);
+        }
+        if(!config.latency_csv.empty()){
+            FILE* f = fopen(config.latency_csv.c_str(), "w");
+            if(f == NULL)
+                throw runtime_error("Error, unable to write " + config.latency_csv);
+            fprintf(f, "cpu,latency,low,high,count\n");
+            for(unsigned int i = 0; i < caches.size(); ++i){
+                char prefix[64];
+                snprintf(prefix, sizeof(prefix), "%u,BusWait", i);
+                caches[i]->bus_wait.print_csv(f, prefix);
+                for(int o = 0; o < OUTCOME_COUNT; ++o){
+                    snprintf(prefix, sizeof(prefix), "%u,%s", i, OUTCOME_NAMES[o]);
+                    caches[i]->latency[o].print_csv(f, prefix);
+                }
+            }
+            fclose(f);
+        }
+        if(config.lt_entries() != 0){
+            printf("CPU\tLTAccesses\tLTSyncs\n");
+            for(unsigned int i = 0; i < cpus.size(); ++i)
+                printf("%u\t%lu\t%lu\n", i, cpus[i]->lt_accesses, cpus[i]->lt_syncs);
+        }
+        if(config.rob > 0){
+            // MLP is the average number of accesses in flight while there is any
+            printf("CPU\tRetired\tCycles\tIPC\tMLP\tMaxMLP\tROBFull\tLSQFull\n");
+            for(unsigned int i = 0; i < cpus.size(); ++i){
+                const CPU::ooo_stats_t& o = cpus[i]->ooo;
+                printf("%u\t%lu\t%lu\t%f\t%f\t%d\t%lu\t%lu\n", i, (unsigned long)o.retired, (unsigned long)o.cycles,
+                       o.cycles ? (double)o.retired / o.cycles : 0.0,
+                       o.busy_cycles ? (double)o.access_cycles / o.busy_cycles : 0.0, o.max_in_flight,
+                       (unsigned long)o.rob_full, (unsigned long)o.lsq_full);
+            }
+        }
+        if(golden_memory != NULL)
+            golden_memory->print();
+        if(config.snoop_filter){
+            printf("CPU\tSnoopsFiltered\tSnoopsDelivered\n");
+            for(unsigned int i = 0; i < caches.size(); ++i)
+                printf("%u\t%lu\t%lu\n", i, (unsigned long)caches[i]->snoop_filter->filtered,
+                       (unsigned long)caches[i]->snoop_filter->delivered);
+        }
     }
 
     catch (exception& e){
@@ -2,11 +2,53 @@
 #define UTILS_MOD
 
 
-static const int MEM_SIZE = 512 * 1024; // Memory size is 2MB
-static const int CACHE_SIZE = 8 * 1024; // Cache size is 32KB
+static const int MEM_PAGE_SIZE = 4096;  // Memory covers the whole 32-bit space, pages are allocated on demand
+static const bool SPARSE_MEMORY_MMAP = false; // reserve the space with mmap instead of the page table
+static const int CACHE_SETS = 128;      // Cache size is 32KB, the geometry could be changed with the configuration
 static const int CACHE_SET_SIZE = 8;
-static const int CACHE_SETS_NUMBER = CACHE_SIZE / CACHE_SET_SIZE;
 static const int MAX_COUNTER = (2048 + 1);
+static const int MAX_CPUS = 64;
+static const int CACHELINE_SIZE = 32;
+static const int CACHELINE_WORDS = CACHELINE_SIZE / 4;
+
+static const int CLOCK_PERIOD_NS = 1;
+static const bool CLOCKED_TIMING = false;   // default of --clocked, wake processes on every clock edge instead of skipping idle ones
+static const bool TRACE_PREFETCH = true;    // decode CPU traces in host threads ahead of the simulation
+static const int TRACE_CHUNK = 4096;        // entries handed over to the simulation at once
+static const int TRACE_CHUNKS_AHEAD = 4;    // chunks a trace reader may run ahead
+static const int LT_QUANTUM = 1000;         // cycles a CPU may run ahead in the loosely timed mode
+
+// Out-of-order core (--ooo), the sizes could be changed with options
+static const int OOO_ROB_SIZE = 64;         // trace entries in flight between dispatch and retirement
+static const int OOO_LSQ_SIZE = 16;         // memory accesses in flight, one MSHR of the cache each
+static const int OOO_ISSUE_WIDTH = 4;       // entries dispatched, issued and retired per cycle
+static const int MAX_MSHRS = 16;            // outstanding accesses per cache, limits the LSQ
+
+// DRAM organization and timings (in cycles), of every memory controller
+static const int MEMORY_CONTROLLERS = 1;
+static const int DRAM_CHANNELS = 1;
+static const int DRAM_BANKS = 8;
+static const int DRAM_ROW_SIZE = 2048;      // bytes per row buffer
+static const bool DRAM_OPEN_PAGE = true;    // keep rows open after access
+static const int DRAM_tRCD = 30;
+static const int DRAM_tCAS = 30;
+static const int DRAM_tRP = 30;
+static const int DRAM_tBURST = 8;
+static const int DRAM_WRITE_QUEUE = 32;     // posted write-backs
+static const int DRAM_WRITE_HIGH = 24;      // start draining writes
+static const int DRAM_WRITE_LOW = 8;        // stop draining writes
+
+static const int LINK_LATENCY = 1;          // cycles per hop of ring/mesh interconnects
+static const int LINK_BYTES_PER_CYCLE = 32; // bandwidth of a bus segment or a link
+
+static const int NUMA_LINK_LATENCY = 40;        // cycles between two NUMA nodes, one way
+static const int NUMA_LINK_BYTES_PER_CYCLE = 16;
+
+static const bool SNOOP_FILTER_ENABLED = true; // filter snoops for lines which are not cached
+static const int SNOOP_FILTER_COUNTERS = 4096;  // 4x more counters than lines of the default cache
+static const int SNOOP_FILTER_HASHES = 2;
+static const int C2C_WORKERS = 4;               // processes per cache which send cache-to-cache transfers
+static const uint64_t BUS_STATS_INTERVAL = 1000; // cycles per row of the bus occupancy time series (--bus-csv)
 
 #define DRAM_IDENTIFIER        0xffffffff
 
@@ -17,10 +59,9 @@ static const int MAX_COUNTER = (2048 + 1);
 #define CACHEL_REQUESTED       0x5  // this is a new state which is needed to show that current cacheline is requested
                                     // to eliminate a problem of two consequative requests and two exclusive states  
 #define CACHEL_INVALID         0x0
+#define CACHEL_FORWARD         0x6  // F state of MESIF
+#define CACHEL_STATES          7
 
-#define CACHETAG_MASK          (~0b111111111111)   // 0b11..10000000000000000
-#define CACHEINDEX_MASK        0b111111100000
-#define CACHETAG_SHIFT         12
 #define CACHEINDEX_SHIFT       5
 
 #endif
\ No newline at end of file
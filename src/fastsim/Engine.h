@@ -0,0 +1,367 @@
+#ifndef ENGINE_MOD
+#define ENGINE_MOD
+
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <stdexcept>
+#include "psa.h"
+#include "../assignment_1/utils.h"
+#include "../assignment_1/Protocol.h"
+#include "../assignment_1/CacheArray.h"
+
+// Latencies of the simple timing model, in cycles
+static const int FAST_HIT_LATENCY = 1;
+static const int FAST_BUS_LATENCY = 2;     // arbitration and one transfer
+static const int FAST_C2C_LATENCY = FAST_BUS_LATENCY + 1;
+static const int FAST_MEMORY_LATENCY = FAST_BUS_LATENCY + DRAM_tRCD + DRAM_tCAS + DRAM_tBURST;
+static const int FAST_QUANTUM = 10000;     // cycles between the barriers of the parallel mode
+
+// The engine keeps no data in its caches, only what the LRU and the protocol need
+struct fast_record_t {
+    int tag;
+    int16_t counter;    // up to MAX_COUNTER
+    int8_t state;
+};
+
+typedef BasicCacheArray<fast_record_t> FastCacheArray;
+
+// All threads wait here until the last one comes, the last one runs the
+// function before it lets them go
+class EpochBarrier {
+    public:
+    explicit EpochBarrier(int threads_) : threads(threads_), waiting(0), generation(0) {}
+
+    void wait(const std::function<void()>& last){
+        std::unique_lock<std::mutex> lock(mutex);
+        unsigned long g = generation;
+        if(++waiting == threads){
+            last();
+            waiting = 0;
+            ++generation;
+            released.notify_all();
+        } else
+            released.wait(lock, [&]{ return generation != g; });
+    }
+
+    private:
+    int threads;
+    int waiting;
+    unsigned long generation;
+    std::mutex mutex;
+    std::condition_variable released;
+};
+
+// Trace driven engine without SystemC. Caches are the same BasicCacheArrays with
+// the same LRU as the SystemC model and every transition comes from the same
+// protocol tables, but a bus transaction is atomic: snoops are applied to all
+// other caches right away and the requestor pays a fixed latency for it.
+// The CPU with the smallest local time always goes next, so CPUs interleave
+// roughly like they would in the timed model.
+//
+// With more than one thread the caches are partitioned by set index, every
+// thread owns the same sets of all caches. A line never leaves its set and
+// snoops only touch its set in the other caches, so the partitions share no
+// state. What they share is the time of the CPUs, which orders the accesses.
+// Threads run in epochs of about quantum cycles: every CPU gets the trace
+// entries which bring it to the end of the epoch at its latency per entry of
+// the last epoch. Inside the epoch a thread knows the latencies of its own
+// accesses exactly and assumes the rate of the last epoch for the accesses of
+// the other partitions. At the barrier the real latencies are summed up, so
+// CPU times are exact again. Only the order of accesses of different CPUs to
+// the same set within one epoch can differ from the serial run, which changes
+// hits and misses of shared lines a little. fastsim --check-serial measures
+// the difference.
+class FastEngine {
+    public:
+    struct traffic_t {
+        unsigned long reads;
+        unsigned long writebacks;
+        unsigned long invalidates;
+        unsigned long updates;
+        unsigned long c2c;
+        unsigned long flushes;
+    } traffic;
+
+    FastEngine(const Protocol* protocol_, int cpus_, int threads_ = 1, int quantum_ = FAST_QUANTUM)
+    : protocol(protocol_), cpus(cpus_), threads(threads_), quantum(quantum_), caches(cpus_), time(cpus_, 0)
+    {
+        if(threads < 1 || threads > CACHE_SETS)
+            throw std::runtime_error("Error, the engine runs on 1 to CACHE_SETS threads");
+        if(quantum < 1)
+            throw std::runtime_error("Error, the quantum needs at least one cycle");
+        memset(&traffic, 0x0, sizeof(traffic));
+        for(int i = 0; i < cpus; ++i)
+            caches[i] = new FastCacheArray();
+    }
+
+    ~FastEngine(){
+        for(int i = 0; i < cpus; ++i)
+            delete caches[i];
+    }
+
+    // Runs the whole trace of every CPU, entries are already decoded
+    // into one vector per CPU. Returns the number of memory accesses.
+    // Hits and misses go to the statistics of psa.
+    unsigned long run(const std::vector<std::vector<TraceFile::Entry> >& traces){
+        std::vector<counters_t> counters(threads, counters_t(cpus));
+        unsigned long accesses = threads == 1 ? run_serial(traces, counters[0]) : run_parallel(traces, counters);
+        for(int c = 0; c < cpus; ++c){
+            cpu_counts_t sum = {0, 0, 0, 0};
+            for(int p = 0; p < threads; ++p){
+                sum.readhit += counters[p].cpu[c].readhit;
+                sum.readmiss += counters[p].cpu[c].readmiss;
+                sum.writehit += counters[p].cpu[c].writehit;
+                sum.writemiss += counters[p].cpu[c].writemiss;
+            }
+            stats_set(c, sum.readhit, sum.readmiss, sum.writehit, sum.writemiss);
+        }
+        for(int p = 0; p < threads; ++p){
+            traffic.reads += counters[p].traffic.reads;
+            traffic.writebacks += counters[p].traffic.writebacks;
+            traffic.invalidates += counters[p].traffic.invalidates;
+            traffic.updates += counters[p].traffic.updates;
+            traffic.c2c += counters[p].traffic.c2c;
+            traffic.flushes += counters[p].traffic.flushes;
+        }
+        return accesses;
+    }
+
+    uint64_t cycles() const{
+        uint64_t max = 0;
+        for(int i = 0; i < cpus; ++i)
+            max = std::max(max, time[i]);
+        return max;
+    }
+
+    private:
+    struct cpu_counts_t {
+        int readhit;
+        int readmiss;
+        int writehit;
+        int writemiss;
+    };
+
+    // Everything one thread counts, summed up after the run
+    struct counters_t {
+        traffic_t traffic;
+        std::vector<cpu_counts_t> cpu;
+
+        explicit counters_t(int cpus) : cpu(cpus) {
+            memset(&traffic, 0x0, sizeof(traffic));
+            memset(&cpu[0], 0x0, sizeof(cpu_counts_t) * cpus);
+        }
+    };
+
+    // State of one thread of the parallel mode
+    struct partition_t {
+        std::vector<std::vector<uint32_t> > entries; // per CPU, trace positions of the accesses to own sets
+        std::vector<size_t> next;                    // per CPU, first entry not done yet
+        std::vector<uint64_t> latency;               // per CPU, of own accesses in this epoch
+        std::vector<double> others;                  // per CPU, latency of other partitions per trace entry
+        unsigned long accesses;
+    };
+
+    const Protocol* protocol;
+    int cpus;
+    int threads;
+    int quantum;
+    std::vector<FastCacheArray*> caches;
+    std::vector<uint64_t> time;
+
+    int partition_of(int addr) const{
+        return (((unsigned int)addr >> CACHEINDEX_SHIFT) & (CACHE_SETS - 1)) % threads;
+    }
+
+    unsigned long run_serial(const std::vector<std::vector<TraceFile::Entry> >& traces, counters_t& k){
+        std::vector<size_t> pos(cpus, 0);
+        unsigned long accesses = 0;
+        int active = 0;
+        for(int i = 0; i < cpus; ++i)
+            if(!traces[i].empty()) ++active;
+        while(active > 0){
+            int cpu = -1;
+            for(int i = 0; i < cpus; ++i)
+                if(pos[i] < traces[i].size() && (cpu < 0 || time[i] < time[cpu]))
+                    cpu = i;
+            const TraceFile::Entry& e = traces[cpu][pos[cpu]];
+            if(++pos[cpu] == traces[cpu].size())
+                --active;
+            time[cpu] += 1; // the step of the CPU itself
+            if(e.type == TraceFile::ENTRY_TYPE_NOP)
+                continue;
+            time[cpu] += access(k, cpu, e.addr, e.type == TraceFile::ENTRY_TYPE_WRITE);
+            ++accesses;
+        }
+        return accesses;
+    }
+
+    unsigned long run_parallel(const std::vector<std::vector<TraceFile::Entry> >& traces, std::vector<counters_t>& counters){
+        std::vector<partition_t> parts(threads);
+        for(int p = 0; p < threads; ++p){
+            parts[p].entries.resize(cpus);
+            parts[p].next.assign(cpus, 0);
+            parts[p].latency.assign(cpus, 0);
+            parts[p].others.assign(cpus, 0.0);
+            parts[p].accesses = 0;
+        }
+        for(int c = 0; c < cpus; ++c)
+            for(size_t k = 0; k < traces[c].size(); ++k)
+                if(traces[c][k].type != TraceFile::ENTRY_TYPE_NOP)
+                    parts[partition_of(traces[c][k].addr)].entries[c].push_back(k);
+
+        // trace entries [start, end) of every CPU make the epoch, time is the
+        // exact time of the CPU at start
+        std::vector<size_t> start(cpus, 0), end(cpus, 0);
+        std::vector<double> per_entry(cpus, FAST_HIT_LATENCY); // latency of all partitions per entry of the last epoch
+        uint64_t horizon = 0;
+        bool done = false;
+        // between the epochs the last thread at the barrier sums up and plans the next one
+        std::function<void()> plan = [&]{
+            uint64_t earliest = UINT64_MAX;
+            for(int c = 0; c < cpus; ++c){
+                uint64_t latency = 0;
+                for(int p = 0; p < threads; ++p)
+                    latency += parts[p].latency[c];
+                size_t n = end[c] - start[c];
+                time[c] += n + latency;
+                if(n > 0){
+                    per_entry[c] = (double)latency / n;
+                    for(int p = 0; p < threads; ++p)
+                        parts[p].others[c] = (double)(latency - parts[p].latency[c]) / n;
+                }
+                for(int p = 0; p < threads; ++p)
+                    parts[p].latency[c] = 0;
+                start[c] = end[c];
+                if(start[c] < traces[c].size())
+                    earliest = std::min(earliest, time[c]);
+            }
+            if(earliest == UINT64_MAX){
+                done = true;
+                return;
+            }
+            horizon = std::max(horizon, earliest) + quantum;
+            for(int c = 0; c < cpus; ++c){
+                size_t n = time[c] >= horizon ? 0 : (size_t)ceil((horizon - time[c]) / (1.0 + per_entry[c]));
+                end[c] = std::min(traces[c].size(), start[c] + n);
+            }
+        };
+        plan();
+        EpochBarrier barrier(threads);
+        std::function<void(int)> worker = [&](int p){
+            while(!done){
+                run_epoch(traces, parts[p], counters[p], start, end);
+                barrier.wait(plan);
+            }
+        };
+        std::vector<std::thread> pool;
+        for(int p = 1; p < threads; ++p)
+            pool.push_back(std::thread(worker, p));
+        worker(0);
+        for(unsigned int i = 0; i < pool.size(); ++i)
+            pool[i].join();
+
+        unsigned long accesses = 0;
+        for(int p = 0; p < threads; ++p)
+            accesses += parts[p].accesses;
+        return accesses;
+    }
+
+    // Accesses of one partition in one epoch, the CPU with the smallest
+    // estimated time goes next like in the serial run
+    void run_epoch(const std::vector<std::vector<TraceFile::Entry> >& traces, partition_t& part, counters_t& k,
+                   const std::vector<size_t>& start, const std::vector<size_t>& end){
+        while(true){
+            int cpu = -1;
+            double best = 0;
+            for(int c = 0; c < cpus; ++c){
+                if(part.next[c] >= part.entries[c].size() || part.entries[c][part.next[c]] >= end[c])
+                    continue;
+                double t = time[c] + (part.entries[c][part.next[c]] - start[c]) * (1.0 + part.others[c]) + part.latency[c];
+                if(cpu < 0 || t < best){
+                    cpu = c;
+                    best = t;
+                }
+            }
+            if(cpu < 0)
+                return;
+            const TraceFile::Entry& e = traces[cpu][part.entries[cpu][part.next[cpu]++]];
+            part.latency[cpu] += access(k, cpu, e.addr, e.type == TraceFile::ENTRY_TYPE_WRITE);
+            ++part.accesses;
+        }
+    }
+
+    // Delivers the bus event to every other cache which holds the line
+    // and returns the ORed actions of their transitions
+    int snoop(counters_t& k, int cpu, int addr, int bus_event){
+        int actions = ACT_NONE;
+        for(int c = 0; c < cpus; ++c){
+            if(c == cpu) continue;
+            int j = caches[c]->find(addr);
+            if(j < 0) continue;
+            const ProtocolTransition& t = protocol->on((*caches[c])[j].state, bus_event);
+            actions |= t.actions;
+            if(t.actions & ACT_FLUSH) ++k.traffic.flushes;
+            (*caches[c])[j].state = t.next;
+        }
+        return actions;
+    }
+
+    // Returns the latency of the access
+    int access(counters_t& k, int cpu, int addr, bool write){
+        FastCacheArray& cache = *caches[cpu];
+        int event = write ? EV_PR_WRITE : EV_PR_READ;
+        int victim;
+        int i = cache.lookup(addr, victim);
+        if(i >= 0){
+            cache[i].counter = MAX_COUNTER;
+            if(write) ++k.cpu[cpu].writehit;
+            else ++k.cpu[cpu].readhit;
+            return FAST_HIT_LATENCY + transition(k, cpu, i, addr, event);
+        }
+
+        if(write) ++k.cpu[cpu].writemiss;
+        else ++k.cpu[cpu].readmiss;
+        int latency = 0;
+        if(protocol->on(cache[victim].state, EV_EVICT).actions & ACT_WRITEBACK){
+            ++k.traffic.writebacks;
+            latency += FAST_BUS_LATENCY;
+        }
+        // the read goes on the bus, every other copy snoops it
+        ++k.traffic.reads;
+        int actions = snoop(k, cpu, addr, EV_BUS_READ);
+        bool supplied = (actions & ACT_SUPPLY) != 0;
+        if(supplied) ++k.traffic.c2c;
+        latency += supplied ? FAST_C2C_LATENCY : FAST_MEMORY_LATENCY;
+        cache[victim].tag = cache.tag_of(addr);
+        cache[victim].counter = MAX_COUNTER;
+        // cacheline which came from other cache is always shared
+        cache[victim].state = protocol->fill_state((actions & (ACT_SHARED | ACT_SUPPLY)) != 0);
+        if(write)
+            latency += transition(k, cpu, victim, addr, EV_PR_WRITE);
+        return latency;
+    }
+
+    // Moves a valid line to its next state, does the bus transaction the
+    // protocol needs for it and returns its latency
+    int transition(counters_t& k, int cpu, int i, int addr, int event){
+        FastCacheArray& cache = *caches[cpu];
+        const ProtocolTransition& t = protocol->on(cache[i].state, event);
+        if(!(t.actions & (ACT_INVALIDATE | ACT_UPDATE))){
+            cache[i].state = t.next;
+            return 0;
+        }
+        int bus_event = (t.actions & ACT_INVALIDATE) ? EV_BUS_INVALIDATE : EV_BUS_UPDATE;
+        if(t.actions & ACT_INVALIDATE) ++k.traffic.invalidates;
+        else ++k.traffic.updates;
+        bool shared = (snoop(k, cpu, addr, bus_event) & ACT_SHARED) != 0;
+        cache[i].state = ((t.actions & ACT_UPDATE) && !shared) ? protocol->update_unshared : t.next;
+        return FAST_BUS_LATENCY;
+    }
+};
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef STACKSIM_MOD
+#define STACKSIM_MOD
+
+#include <stdint.h>
+#include <vector>
+#include "psa.h"
+#include "../assignment_1/utils.h"
+#include "../assignment_1/Protocol.h"
+
+// Single pass simulation of many cache geometries at once (all-associativity
+// simulation). For every number of sets every set keeps one LRU stack of
+// lines, a cache with A ways holds exactly the top A entries of the stacks,
+// so the depth at which an access finds its line tells hit or miss for every
+// associativity up to max_ways.
+// Every CPU has its own stacks. With an invalidating protocol a write takes
+// the line out of the stacks of the other CPUs. It leaves a hole, which is a
+// free way for the caches which held the line: the next line which comes to
+// the top only shifts the entries above the first hole, so the caches below
+// don't lose a line they didn't have to. Empty stacks are all holes, like
+// empty caches. CPUs take one trace entry each in turn, NOPs included.
+class StackSim {
+    public:
+    // sets are 2^min_sets_log .. 2^max_sets_log
+    StackSim(const Protocol* protocol, int cpus_, int min_sets_log_, int max_sets_log_, int max_ways_)
+    : accesses(0), invalidations(0), cpus(cpus_), min_sets_log(min_sets_log_), max_ways(max_ways_)
+    {
+        // update protocols keep the copies of the other caches
+        invalidating = !(protocol->on(CACHEL_SHARED, EV_PR_WRITE).actions & ACT_UPDATE);
+        for(int s = min_sets_log_; s <= max_sets_log_; ++s){
+            geometry_t g;
+            g.sets = 1 << s;
+            g.depths.assign(max_ways + 1, 0);
+            g.stacks.assign(cpus, std::vector<int32_t>((size_t)g.sets * max_ways, HOLE));
+            geometries.push_back(g);
+        }
+    }
+
+    void run(const std::vector<std::vector<TraceFile::Entry> >& traces){
+        size_t longest = 0;
+        for(int i = 0; i < cpus; ++i)
+            longest = std::max(longest, traces[i].size());
+        for(size_t k = 0; k < longest; ++k)
+            for(int i = 0; i < cpus; ++i){
+                if(k >= traces[i].size() || traces[i][k].type == TraceFile::ENTRY_TYPE_NOP)
+                    continue;
+                access(i, traces[i][k].addr / CACHELINE_SIZE, traces[i][k].type == TraceFile::ENTRY_TYPE_WRITE);
+            }
+    }
+
+    int geometry_count() const{ return geometries.size(); }
+    int sets(int g) const{ return geometries[g].sets; }
+    int sets_log(int g) const{ return min_sets_log + g; }
+
+    // Hits of the cache with the sets of geometry g and the ways
+    uint64_t hits(int g, int ways) const{
+        uint64_t h = 0;
+        for(int d = 0; d < ways; ++d)
+            h += geometries[g].depths[d];
+        return h;
+    }
+
+    uint64_t accesses;      // reads and writes of all CPUs
+    uint64_t invalidations; // lines taken out of other stacks, over all geometries
+
+    private:
+    static const int32_t HOLE = -1;
+
+    struct geometry_t {
+        int sets;
+        std::vector<uint64_t> depths;              // accesses by the depth of their hit, max_ways is a miss
+        std::vector<std::vector<int32_t> > stacks; // per CPU, max_ways entries per set, MRU first
+    };
+
+    int cpus;
+    int min_sets_log;
+    int max_ways;
+    bool invalidating;
+    std::vector<geometry_t> geometries;
+
+    void access(int cpu, uint32_t line, bool write){
+        ++accesses;
+        for(unsigned int g = 0; g < geometries.size(); ++g){
+            geometry_t& geo = geometries[g];
+            int32_t* stack = &geo.stacks[cpu][(size_t)(line & (geo.sets - 1)) * max_ways];
+            int depth = 0;
+            while(depth < max_ways && stack[depth] != (int32_t)line)
+                ++depth;
+            ++geo.depths[depth];
+            // the line goes to the top, the entries above it (or above the
+            // first hole) move one down, the last one falls out on a miss
+            int last = std::min(depth, max_ways - 1);
+            for(int d = 0; d < last; ++d)
+                if(stack[d] == HOLE){
+                    last = d;
+                    break;
+                }
+            if(depth < max_ways && last < depth)
+                stack[depth] = HOLE; // hole was filled, the old place of the line is free now
+            for(int d = last; d > 0; --d)
+                stack[d] = stack[d - 1];
+            stack[0] = line;
+            if(!write || !invalidating)
+                continue;
+            for(int c = 0; c < cpus; ++c){
+                if(c == cpu) continue;
+                int32_t* other = &geo.stacks[c][(size_t)(line & (geo.sets - 1)) * max_ways];
+                for(int d = 0; d < max_ways; ++d)
+                    if(other[d] == (int32_t)line){
+                        other[d] = HOLE;
+                        ++invalidations;
+                        break;
+                    }
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,276 @@
+/*
+ * File: fastsim.cpp
+ *
+ * Standalone trace driven simulator without SystemC. It uses the cache arrays
+ * and the protocol tables of assignment_1 with a simple latency model, so it
+ * runs orders of magnitude faster and is good for quick design space scans.
+ * Arguments are the same as for assignment_1:
+ *   fastsim.bin <tracefile> <cpus> [protocol] [--validate=<assignment_1 output>] [--tolerance=<percent>]
+ *               [--stack[=<min sets>:<max sets>:<max ways>]]
+ *               [--threads=<N>] [--quantum=<cycles>] [--check-serial]
+ * The number of cpus has to be the one of the trace.
+ * With --validate the hit/miss counts are compared with the ones printed by
+ * the SystemC model for the same trace and protocol.
+ * --threads runs the engine on N host threads, the caches are partitioned by
+ * set and the threads meet every quantum cycles (see Engine.h). Its results
+ * may differ a little from the serial run, --check-serial runs the serial
+ * engine as well and fails if a hit/miss counter or the cycles differ by more
+ * than the tolerance.
+ * --stack evaluates every LRU geometry with a power of two number of sets and
+ * up to max ways in one pass over the trace and prints the hit/miss matrix
+ * instead of running the timing model.
+ */
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "psa.h"
+#include "Engine.h"
+#include "StackSim.h"
+
+using namespace std;
+
+struct cpu_counts_t {
+    int readhit;
+    int readmiss;
+    int writehit;
+    int writemiss;
+};
+
+// Reads the "CPU Reads RHit RMiss Writes WHit WMiss Hitrate" table of stats_print
+static vector<cpu_counts_t> read_reference(const char* filename){
+    ifstream in(filename);
+    if(!in.good())
+        throw runtime_error(string("Error, unable to open ") + filename);
+    vector<cpu_counts_t> counts;
+    string line;
+    bool table = false;
+    while(getline(in, line)){
+        if(line.compare(0, 10, "CPU\tReads\t") == 0){
+            table = true;
+            counts.clear();
+            continue;
+        }
+        if(!table) continue;
+        int cpu, reads, writes;
+        cpu_counts_t c;
+        if(sscanf(line.c_str(), "%d\t%d\t%d\t%d\t%d\t%d\t%d", &cpu, &reads, &c.readhit, &c.readmiss,
+                  &writes, &c.writehit, &c.writemiss) != 7){
+            table = false; // end of the table
+            continue;
+        }
+        counts.push_back(c);
+    }
+    if(counts.empty())
+        throw runtime_error(string("Error, no statistics table in ") + filename);
+    return counts;
+}
+
+static bool within(double ours, double reference, double tolerance){
+    return fabs(ours - reference) <= tolerance / 100.0 * max(reference, 1.0);
+}
+
+static vector<cpu_counts_t> current_counts(){
+    vector<cpu_counts_t> counts(num_cpus);
+    for(uint32_t i = 0; i < num_cpus; ++i){
+        counts[i].readhit = stats_readhits(i);
+        counts[i].readmiss = stats_readmisses(i);
+        counts[i].writehit = stats_writehits(i);
+        counts[i].writemiss = stats_writemisses(i);
+    }
+    return counts;
+}
+
+static double seconds_since(const timespec& start){
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Returns the number of counters which are off by more than the tolerance
+static int validate(const vector<cpu_counts_t>& reference, const vector<cpu_counts_t>& ours, double tolerance,
+                    const char* reference_name){
+    if(reference.size() != ours.size()){
+        printf("Reference has %u CPUs, simulated %u\n", (unsigned int)reference.size(), (unsigned int)ours.size());
+        return 1;
+    }
+    int mismatches = 0;
+    printf("CPU\tCounter\tFast\t%s\tDiff%%\n", reference_name);
+    for(unsigned int i = 0; i < ours.size(); ++i){
+        const char* names[] = {"RHit", "RMiss", "WHit", "WMiss"};
+        int a[] = {ours[i].readhit, ours[i].readmiss, ours[i].writehit, ours[i].writemiss};
+        int b[] = {reference[i].readhit, reference[i].readmiss, reference[i].writehit, reference[i].writemiss};
+        for(int k = 0; k < 4; ++k){
+            bool ok = within(a[k], b[k], tolerance);
+            printf("%u\t%s\t%d\t%d\t%f%s\n", i, names[k], a[k], b[k],
+                   100.0 * (a[k] - b[k]) / max(b[k], 1), ok ? "" : "\tMISMATCH");
+            if(!ok) ++mismatches;
+        }
+    }
+    return mismatches;
+}
+
+int main(int argc, char* argv[])
+{
+    timespec time1, time2;
+    try
+    {
+        const char* reference = NULL;
+        double tolerance = 1.0; // percent
+        bool stack = false;
+        int threads = 1, quantum = FAST_QUANTUM;
+        bool check_serial = false;
+        int min_sets = 16, max_sets = 4096, max_ways = 16;
+        int nargs = 1;
+        for(int i = 1; i < argc; ++i){
+            if(strncmp(argv[i], "--validate=", 11) == 0)
+                reference = argv[i] + 11;
+            else if(strncmp(argv[i], "--tolerance=", 12) == 0)
+                tolerance = atof(argv[i] + 12);
+            else if(strncmp(argv[i], "--threads=", 10) == 0)
+                threads = atoi(argv[i] + 10);
+            else if(strncmp(argv[i], "--quantum=", 10) == 0)
+                quantum = atoi(argv[i] + 10);
+            else if(strcmp(argv[i], "--check-serial") == 0)
+                check_serial = true;
+            else if(strcmp(argv[i], "--stack") == 0)
+                stack = true;
+            else if(strncmp(argv[i], "--stack=", 8) == 0){
+                stack = true;
+                if(sscanf(argv[i] + 8, "%d:%d:%d", &min_sets, &max_sets, &max_ways) != 3)
+                    throw runtime_error(string("Error, expected --stack=<min sets>:<max sets>:<max ways>, got ") + argv[i]);
+            }
+            else if(strncmp(argv[i], "--", 2) == 0)
+                throw runtime_error(string("Error, unknown option ") + argv[i]);
+            else
+                argv[nargs++] = argv[i];
+        }
+        argc = nargs;
+        // This function sets tracefile_ptr and num_cpus
+        init_tracefile(&argc, &argv);
+        if(num_cpus > MAX_CPUS)
+            throw runtime_error("Error, too many CPUs");
+        // the engine runs every processor of the trace, a different count would be another system
+        if(argc > 1 && atoi(argv[0]) != (int)num_cpus)
+            throw runtime_error("Error, the trace has " + to_string(num_cpus) + " processors, not " + argv[0]);
+        const Protocol* protocol = &PROTOCOL_MOESI;
+        if(argc > 2)
+            protocol = Protocol::by_name(argv[1]);
+        stats_init();
+
+        // the whole trace is decoded up front, the loop doesn't touch the file
+        vector<vector<TraceFile::Entry> > traces(num_cpus);
+        while(!tracefile_ptr->eof()){
+            for(uint32_t i = 0; i < num_cpus; ++i){
+                if(tracefile_ptr->finished(i)) continue;
+                TraceFile::Entry e;
+                if(!tracefile_ptr->next(i, e))
+                    throw runtime_error("Error, unable to read the tracefile");
+                traces[i].push_back(e);
+            }
+        }
+
+        if(stack){
+            if(min_sets < 1 || max_sets < min_sets || (min_sets & (min_sets - 1)) || (max_sets & (max_sets - 1)) ||
+               max_ways < 1)
+                throw runtime_error("Error, numbers of sets have to be powers of two and there has to be a way");
+            StackSim sim(protocol, num_cpus, __builtin_ctz(min_sets), __builtin_ctz(max_sets), max_ways);
+            cout << "Running " << protocol->name << " for " << sim.geometry_count() * max_ways << " geometries in one pass... " << endl;
+            clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time1);
+            sim.run(traces);
+            clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time2);
+            double seconds = (time2.tv_sec - time1.tv_sec) + (time2.tv_nsec - time1.tv_nsec) / 1e9;
+            printf("Sets\tWays\tSizeKB\tHits\tMisses\tMissRate\n");
+            for(int g = 0; g < sim.geometry_count(); ++g)
+                for(int w = 1; w <= max_ways; ++w){
+                    uint64_t hits = sim.hits(g, w);
+                    printf("%d\t%d\t%f\t%lu\t%lu\t%f\n", sim.sets(g), w, sim.sets(g) * w * CACHELINE_SIZE / 1024.0,
+                           (unsigned long)hits, (unsigned long)(sim.accesses - hits),
+                           sim.accesses ? 100.0 * (sim.accesses - hits) / sim.accesses : 0.0);
+                }
+            // the same miss rates as a matrix, sets down and ways across
+            printf("Sets\\Ways");
+            for(int w = 1; w <= max_ways; ++w)
+                printf("\t%d", w);
+            printf("\n");
+            for(int g = 0; g < sim.geometry_count(); ++g){
+                printf("%d", sim.sets(g));
+                for(int w = 1; w <= max_ways; ++w)
+                    printf("\t%f", sim.accesses ? 100.0 * (sim.accesses - sim.hits(g, w)) / sim.accesses : 0.0);
+                printf("\n");
+            }
+            printf("Accesses %lu, invalidations %lu, total execution time %u ms\n", (unsigned long)sim.accesses,
+                   (unsigned long)sim.invalidations, (unsigned int)(seconds * 1e3));
+            stats_cleanup();
+            return 0;
+        }
+
+        // the serial reference goes first, the parallel run leaves its statistics for the report
+        vector<cpu_counts_t> serial_counts;
+        uint64_t serial_cycles = 0;
+        double serial_seconds = 0;
+        if(check_serial && threads > 1){
+            FastEngine serial(protocol, num_cpus);
+            cout << "Running " << protocol->name << " serially for the reference... " << endl;
+            clock_gettime(CLOCK_MONOTONIC, &time1);
+            serial.run(traces);
+            serial_seconds = seconds_since(time1);
+            serial_counts = current_counts();
+            serial_cycles = serial.cycles();
+        }
+
+        FastEngine engine(protocol, num_cpus, threads, quantum);
+        cout << "Running " << protocol->name << " without SystemC on " << threads << " threads... " << endl;
+        // wall clock time, the threads run at once
+        clock_gettime(CLOCK_MONOTONIC, &time1);
+        unsigned long accesses = engine.run(traces);
+        double seconds = seconds_since(time1);
+
+        stats_print();
+        // counted like assignment_1 does it: every read and writeback on the bus
+        printf("Main memory access rate = %lu\n", engine.traffic.reads + engine.traffic.writebacks);
+        printf("Total execution time %u ms\n", (unsigned int)(seconds * 1e3));
+        printf("Accesses %lu, %f M accesses/s\n", accesses, seconds > 0 ? accesses / seconds / 1e6 : 0.0);
+        printf("Protocol %s, simulated cycles %lu (fast model)\n", protocol->name, (unsigned long)engine.cycles());
+        printf("Bus\tReads\tWBacks\tInvals\tUpdates\tC2C\tFlushes\n");
+        printf("\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\n", engine.traffic.reads, engine.traffic.writebacks,
+               engine.traffic.invalidates, engine.traffic.updates, engine.traffic.c2c, engine.traffic.flushes);
+
+        if(!serial_counts.empty()){
+            printf("Parallel run against the serial one:\n");
+            int mismatches = validate(serial_counts, current_counts(), tolerance, "Serial");
+            bool cycles_ok = within(engine.cycles(), serial_cycles, tolerance);
+            printf("Cycles\t%lu\t%lu\t%f%s\n", (unsigned long)engine.cycles(), (unsigned long)serial_cycles,
+                   100.0 * ((double)engine.cycles() - serial_cycles) / max(serial_cycles, (uint64_t)1),
+                   cycles_ok ? "" : "\tMISMATCH");
+            if(!cycles_ok) ++mismatches;
+            printf("Serial %u ms, parallel %u ms on %d threads, speedup %f\n", (unsigned int)(serial_seconds * 1e3),
+                   (unsigned int)(seconds * 1e3), threads, seconds > 0 ? serial_seconds / seconds : 0.0);
+            printf("Check against the serial run: %s (tolerance %f%%)\n", mismatches == 0 ? "PASSED" : "FAILED", tolerance);
+            if(mismatches != 0){
+                stats_cleanup();
+                return 1;
+            }
+        }
+
+        if(reference != NULL){
+            int mismatches = validate(read_reference(reference), current_counts(), tolerance, "SystemC");
+            printf("Validation against %s: %s (tolerance %f%%)\n", reference,
+                   mismatches == 0 ? "PASSED" : "FAILED", tolerance);
+            stats_cleanup();
+            return mismatches == 0 ? 0 : 1;
+        }
+        stats_cleanup();
+    }
+
+    catch (exception& e){
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
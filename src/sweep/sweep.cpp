@@ -0,0 +1,396 @@
+/*
+ * File: sweep.cpp
+ *
+ * Runs a simulator binary over a matrix of traces and configurations in
+ * parallel worker processes and collects the results into one CSV file.
+ *   sweep.bin <simulator> <matrix file> [--jobs=N] [--cache=DIR] [--out=FILE]
+ *
+ * The matrix file has one entry per line, '#' starts a comment:
+ *   trace  <file or glob pattern>...
+ *   config <name> <arguments after the trace>...
+ * e.g.
+ *   trace  tracefiles/fft_16_p*.trf
+ *   config moesi --protocol=MOESI
+ *   config dragon_ring --protocol=Dragon --topology=ring
+ * Every trace runs with every config. Every worker is pinned to its own host
+ * core. The output of a run is kept in the cache directory under the hash of
+ * (simulator binary, arguments, trace contents, contents of the files the
+ * arguments name), so points which didn't change are not simulated again,
+ * and points with the same key are simulated once.
+ * Files named by a configuration file (--config=FILE) count as well, files
+ * the simulator writes don't.
+ * A run failed if it exits with an error or doesn't print the statistics
+ * table. Failed points are in the CSV too, with status "failed" and no
+ * numbers, and the sweep exits with an error.
+ */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <stdexcept>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <glob.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+struct config_t {
+    string name;
+    vector<string> args;
+};
+
+struct point_t {
+    string trace;
+    const config_t* config;
+    string key;     // hash of binary, arguments and trace
+    bool cached;
+    bool failed;
+};
+
+// 64-bit FNV-1a, good enough to tell files apart
+static uint64_t fnv(const void* data, size_t size, uint64_t h = 0xcbf29ce484222325ULL){
+    const unsigned char* p = (const unsigned char*)data;
+    for(size_t i = 0; i < size; ++i){
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint64_t hash_file(const string& filename){
+    FILE* f = fopen(filename.c_str(), "rb");
+    if(f == NULL)
+        throw runtime_error("Error, unable to open " + filename);
+    uint64_t h = 0xcbf29ce484222325ULL;
+    char buffer[65536];
+    size_t n;
+    while((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        h = fnv(buffer, n, h);
+    fclose(f);
+    return h;
+}
+
+// Options which name files the simulator writes, they don't tell runs apart
+static const char* const OUTPUT_KEYS[] = {"checkpoint", "latency-csv", "bus-csv", "csv"};
+
+static bool is_output_key(const string& key){
+    for(unsigned int i = 0; i < sizeof(OUTPUT_KEYS) / sizeof(OUTPUT_KEYS[0]); ++i)
+        if(key == OUTPUT_KEYS[i])
+            return true;
+    return false;
+}
+
+static bool is_file(const string& name){
+    struct stat st;
+    return stat(name.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+static string trim(const string& s){
+    size_t begin = s.find_first_not_of(" \t\r\n");
+    if(begin == string::npos)
+        return "";
+    return s.substr(begin, s.find_last_not_of(" \t\r\n") - begin + 1);
+}
+
+// Adds one argument to the hash: "--key=value" or a plain value. If the value
+// names an input file its contents go in too, and a configuration file is
+// looked through for the files its keys name.
+static uint64_t hash_argument(const string& arg, uint64_t h){
+    h = fnv(arg.c_str(), arg.size() + 1, h);
+    string key, value = arg;
+    if(arg.compare(0, 2, "--") == 0){
+        size_t eq = arg.find('=');
+        if(eq == string::npos)
+            return h;
+        key = arg.substr(2, eq - 2);
+        value = arg.substr(eq + 1);
+    }
+    if(is_output_key(key) || !is_file(value))
+        return h;
+    uint64_t contents = hash_file(value);
+    h = fnv(&contents, sizeof(contents), h);
+    if(key == "config"){
+        ifstream in(value.c_str());
+        string line;
+        while(getline(in, line)){
+            line = line.substr(0, line.find('#'));
+            size_t eq = line.find('=');
+            if(eq == string::npos)
+                continue;
+            // the same as an option, without the configuration key which would loop
+            string k = trim(line.substr(0, eq));
+            if(k != "config")
+                h = hash_argument("--" + k + "=" + trim(line.substr(eq + 1)), h);
+        }
+    }
+    return h;
+}
+
+static vector<config_t> read_matrix(const char* filename, vector<string>& traces){
+    ifstream in(filename);
+    if(!in.good())
+        throw runtime_error(string("Error, unable to open ") + filename);
+    vector<config_t> configs;
+    string line;
+    while(getline(in, line)){
+        line = line.substr(0, line.find('#'));
+        istringstream words(line);
+        string kind;
+        if(!(words >> kind)) continue;
+        if(kind == "trace"){
+            string pattern;
+            while(words >> pattern){
+                glob_t g;
+                if(glob(pattern.c_str(), 0, NULL, &g) != 0)
+                    throw runtime_error("Error, no traces match " + pattern);
+                for(size_t i = 0; i < g.gl_pathc; ++i)
+                    traces.push_back(g.gl_pathv[i]);
+                globfree(&g);
+            }
+        } else if(kind == "config"){
+            config_t c;
+            if(!(words >> c.name))
+                throw runtime_error("Error, config without a name in " + string(filename));
+            string arg;
+            while(words >> arg)
+                c.args.push_back(arg);
+            configs.push_back(c);
+        } else
+            throw runtime_error("Error, unknown matrix entry " + kind);
+    }
+    if(traces.empty() || configs.empty())
+        throw runtime_error(string("Error, no traces or no configs in ") + filename);
+    return configs;
+}
+
+// Forks a worker pinned to the core, its output goes to the file
+static pid_t launch(const char* simulator, const point_t& p, int core, const string& output){
+    pid_t pid = fork();
+    if(pid < 0)
+        throw runtime_error("Error, unable to fork a worker");
+    if(pid > 0)
+        return pid;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    sched_setaffinity(0, sizeof(set), &set); // not fatal, the run is only slower
+    int fd = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        _exit(127);
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    close(fd);
+    vector<char*> argv;
+    argv.push_back((char*)simulator);
+    argv.push_back((char*)p.trace.c_str());
+    for(unsigned int i = 0; i < p.config->args.size(); ++i)
+        argv.push_back((char*)p.config->args[i].c_str());
+    argv.push_back(NULL);
+    execv(simulator, &argv[0]);
+    _exit(127);
+}
+
+struct result_t {
+    long reads, readhit, readmiss, writes, writehit, writemiss;
+    long memory_accesses;
+    long execution_ms;
+    unsigned long cycles;
+    string protocol;
+    bool complete; // the statistics table was printed, the run got to its end
+    result_t() : reads(0), readhit(0), readmiss(0), writes(0), writehit(0), writemiss(0),
+                 memory_accesses(0), execution_ms(0), cycles(0), complete(false) {}
+};
+
+// Sums up the per CPU statistics table and picks the totals the simulators print
+static result_t parse_output(const string& filename){
+    result_t r;
+    ifstream in(filename.c_str());
+    string line;
+    bool table = false;
+    while(getline(in, line)){
+        int cpu, reads, rhit, rmiss, writes, whit, wmiss;
+        char name[32];
+        if(line.compare(0, 10, "CPU\tReads\t") == 0){
+            table = true;
+            r.complete = true;
+            continue;
+        }
+        if(table && sscanf(line.c_str(), "%d\t%d\t%d\t%d\t%d\t%d\t%d", &cpu, &reads, &rhit, &rmiss,
+                           &writes, &whit, &wmiss) == 7){
+            r.reads += reads;
+            r.readhit += rhit;
+            r.readmiss += rmiss;
+            r.writes += writes;
+            r.writehit += whit;
+            r.writemiss += wmiss;
+            continue;
+        }
+        table = false;
+        sscanf(line.c_str(), "Main memory access rate = %ld", &r.memory_accesses);
+        sscanf(line.c_str(), "Total execution time %ld ms", &r.execution_ms);
+        sscanf(line.c_str(), "Simulated cycles %lu", &r.cycles);
+        // the fast model prints its cycles on the protocol line
+        if(sscanf(line.c_str(), "Protocol %31[^,], simulated cycles %lu", name, &r.cycles) >= 1)
+            r.protocol = name;
+    }
+    return r;
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        int jobs = cores;
+        string cache_dir = "sweep_cache";
+        const char* out = "sweep.csv";
+        int nargs = 1;
+        for(int i = 1; i < argc; ++i){
+            if(strncmp(argv[i], "--jobs=", 7) == 0)
+                jobs = atoi(argv[i] + 7);
+            else if(strncmp(argv[i], "--cache=", 8) == 0)
+                cache_dir = argv[i] + 8;
+            else if(strncmp(argv[i], "--out=", 6) == 0)
+                out = argv[i] + 6;
+            else if(strncmp(argv[i], "--", 2) == 0)
+                throw runtime_error(string("Error, unknown option ") + argv[i]);
+            else
+                argv[nargs++] = argv[i];
+        }
+        if(nargs < 3)
+            throw runtime_error(string("Error, usage: ") + argv[0] +
+                                " <simulator> <matrix file> [--jobs=N] [--cache=DIR] [--out=FILE]");
+        const char* simulator = argv[1];
+        jobs = max(1, jobs);
+        vector<string> traces;
+        vector<config_t> configs = read_matrix(argv[2], traces);
+        mkdir(cache_dir.c_str(), 0755);
+
+        // keys of all points, files are hashed only once
+        uint64_t binary = hash_file(simulator);
+        map<string, uint64_t> trace_hashes;
+        vector<point_t> points;
+        // points with the same key share one run, it writes the files of the key
+        map<string, vector<unsigned int> > same_key;
+        vector<unsigned int> runs;
+        for(unsigned int t = 0; t < traces.size(); ++t){
+            if(trace_hashes.find(traces[t]) == trace_hashes.end())
+                trace_hashes[traces[t]] = hash_file(traces[t]);
+            for(unsigned int c = 0; c < configs.size(); ++c){
+                point_t p;
+                p.trace = traces[t];
+                p.config = &configs[c];
+                uint64_t h = fnv(&binary, sizeof(binary));
+                h = fnv(&trace_hashes[traces[t]], sizeof(uint64_t), h);
+                for(unsigned int a = 0; a < configs[c].args.size(); ++a)
+                    h = hash_argument(configs[c].args[a], h);
+                char key[17];
+                snprintf(key, sizeof(key), "%016llx", (unsigned long long)h);
+                p.key = key;
+                // an output without the statistics is no result, the run is done again
+                p.cached = access((cache_dir + "/" + p.key + ".out").c_str(), F_OK) == 0 &&
+                           parse_output(cache_dir + "/" + p.key + ".out").complete;
+                p.failed = false;
+                if(!p.cached && same_key.find(p.key) == same_key.end())
+                    runs.push_back(points.size());
+                same_key[p.key].push_back(points.size());
+                points.push_back(p);
+            }
+        }
+
+        // at most one worker per core slot, a slot is free when its worker is done
+        vector<pid_t> slots(jobs, 0);
+        map<pid_t, unsigned int> running;
+        unsigned int next = 0;
+        unsigned int done = 0;
+        unsigned int simulated = 0;
+        unsigned int failed = 0;
+        while(true){
+            int slot = -1;
+            for(int s = 0; s < jobs && slot < 0; ++s)
+                if(slots[s] == 0) slot = s;
+            if(next < runs.size() && slot >= 0){
+                unsigned int first = runs[next++];
+                const point_t& p = points[first];
+                cout << "Running " << p.trace << " " << p.config->name << endl;
+                slots[slot] = launch(simulator, p, slot % cores, cache_dir + "/" + p.key + ".tmp");
+                running[slots[slot]] = first;
+                continue;
+            }
+            if(running.empty())
+                break;
+            int status;
+            pid_t pid = waitpid(-1, &status, 0);
+            if(pid < 0)
+                throw runtime_error("Error, lost the workers");
+            if(running.find(pid) == running.end())
+                continue;
+            const point_t& p = points[running[pid]];
+            running.erase(pid);
+            for(int s = 0; s < jobs; ++s)
+                if(slots[s] == pid) slots[s] = 0;
+            string tmp = cache_dir + "/" + p.key + ".tmp";
+            // only complete runs go to the cache, a failed one is tried again next time.
+            // The simulator prints a bad configuration and still exits with 0, so a
+            // run without the statistics table failed as well
+            bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 && parse_output(tmp).complete;
+            if(ok)
+                rename(tmp.c_str(), (cache_dir + "/" + p.key + ".out").c_str());
+            else
+                cerr << "Run of " << p.trace << " " << p.config->name << " failed, see " << tmp << endl;
+            const vector<unsigned int>& shared = same_key[p.key];
+            for(unsigned int i = 0; i < shared.size(); ++i){
+                points[shared[i]].failed = !ok;
+                failed += !ok;
+                ++simulated;
+            }
+            cout << "Done " << ++done << "/" << runs.size() << endl;
+        }
+
+        FILE* f = fopen(out, "w");
+        if(f == NULL)
+            throw runtime_error(string("Error, unable to write ") + out);
+        fprintf(f, "trace,config,arguments,protocol,reads,readhit,readmiss,writes,writehit,writemiss,"
+                   "hitrate,memory_accesses,cycles,execution_ms,cached,status\n");
+        for(unsigned int i = 0; i < points.size(); ++i){
+            const point_t& p = points[i];
+            string args;
+            for(unsigned int a = 0; a < p.config->args.size(); ++a)
+                args += (a ? " " : "") + p.config->args[a];
+            if(p.failed){
+                // no numbers, the output of the run is in the .tmp file of its key
+                fprintf(f, "%s,%s,%s,,,,,,,,,,,,0,failed\n", p.trace.c_str(), p.config->name.c_str(), args.c_str());
+                continue;
+            }
+            result_t r = parse_output(cache_dir + "/" + p.key + ".out");
+            long accesses = r.reads + r.writes;
+            fprintf(f, "%s,%s,%s,%s,%ld,%ld,%ld,%ld,%ld,%ld,%f,%ld,%lu,%ld,%d,ok\n", p.trace.c_str(),
+                    p.config->name.c_str(), args.c_str(), r.protocol.c_str(), r.reads, r.readhit,
+                    r.readmiss, r.writes, r.writehit, r.writemiss,
+                    accesses ? 100.0 * (r.readhit + r.writehit) / accesses : 0.0,
+                    r.memory_accesses, r.cycles, r.execution_ms, p.cached ? 1 : 0);
+        }
+        fclose(f);
+        printf("Points %u, simulated %u, from cache %u, failed %u, results in %s\n", (unsigned int)points.size(),
+               simulated, (unsigned int)(points.size() - simulated), failed, out);
+        if(failed != 0){
+            cerr << "Error, " << failed << " of " << points.size() << " points failed" << endl;
+            return 1;
+        }
+    }
+
+    catch (exception& e){
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,266 @@
+/*
+ * File: traceanalyze.cpp
+ *
+ * Tells what a trace looks like before it's simulated:
+ *   traceanalyze.bin <tracefile> [--window=N] [--csv=FILE]
+ * - reads, writes and NOPs of every CPU
+ * - LRU stack reuse distance histogram of every CPU and of all CPUs together
+ *   (in the order the simulators interleave them), in cachelines
+ * - miss rate curve of a fully associative LRU cache, exact for every power
+ *   of two size, so cache sizing doesn't need a sweep
+ * - working set (distinct lines) in windows of N accesses of a CPU
+ * - sharing: lines by the number of CPUs which touch them, and how many of
+ *   them are written
+ * --csv writes the working set of every window.
+ */
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <stdexcept>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "psa.h"
+#include "../assignment_1/utils.h"
+
+using namespace std;
+
+static const int DISTANCE_BUCKETS = 34; // 0, then [2^(k-1), 2^k) up to 2^32
+static const int CURVE_MIN = 4;         // smallest size of the curve, 2^4 lines
+static const int CURVE_MAX = 20;        // largest one, 2^20 lines
+
+// Stack distance of every access: the number of other lines accessed since
+// the last access of the same line. Every line marks the time of its last
+// access in a Fenwick tree, the distance is the number of marks after it,
+// O(log n) per access.
+class ReuseDistance {
+    public:
+    vector<uint64_t> histogram; // bucket 0 is distance 0, bucket k is [2^(k-1), 2^k)
+    uint64_t cold;              // first accesses of lines
+
+    explicit ReuseDistance(uint64_t accesses)
+    : histogram(DISTANCE_BUCKETS, 0), cold(0), tree(accesses + 1, 0), time(0) {}
+
+    void access(uint32_t line){
+        ++time;
+        unordered_map<uint32_t, uint64_t>::iterator it = last.find(line);
+        if(it == last.end()){
+            ++cold;
+            last[line] = time;
+        } else {
+            uint64_t distance = sum(time - 1) - sum(it->second);
+            ++histogram[bucket(distance)];
+            add(it->second, -1);
+            it->second = time;
+        }
+        add(time, 1);
+    }
+
+    static int bucket(uint64_t distance){
+        int b = 0;
+        while(distance > 0){
+            distance >>= 1;
+            ++b;
+        }
+        return b;
+    }
+
+    // Misses of a fully associative LRU cache of 2^k lines, an access hits
+    // if its distance is below the size
+    uint64_t misses(int k) const{
+        uint64_t m = cold;
+        for(int b = k + 1; b < DISTANCE_BUCKETS; ++b)
+            m += histogram[b];
+        return m;
+    }
+
+    private:
+    vector<int32_t> tree;
+    unordered_map<uint32_t, uint64_t> last;
+    uint64_t time;
+
+    void add(uint64_t i, int32_t value){
+        for(; i < tree.size(); i += i & (~i + 1))
+            tree[i] += value;
+    }
+
+    uint64_t sum(uint64_t i) const{
+        uint64_t s = 0;
+        for(; i > 0; i -= i & (~i + 1))
+            s += tree[i];
+        return s;
+    }
+};
+
+struct sharing_t {
+    uint64_t readers; // CPUs as bits
+    uint64_t writers;
+};
+
+static int bits(uint64_t v){
+    return __builtin_popcountll(v);
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        uint64_t window = 10000;
+        const char* csv = NULL;
+        int nargs = 1;
+        for(int i = 1; i < argc; ++i){
+            if(strncmp(argv[i], "--window=", 9) == 0)
+                window = strtoull(argv[i] + 9, NULL, 10);
+            else if(strncmp(argv[i], "--csv=", 6) == 0)
+                csv = argv[i] + 6;
+            else if(strncmp(argv[i], "--", 2) == 0)
+                throw runtime_error(string("Error, unknown option ") + argv[i]);
+            else
+                argv[nargs++] = argv[i];
+        }
+        argc = nargs;
+        if(window == 0)
+            throw runtime_error("Error, window has to have at least one access");
+        // This function sets tracefile_ptr and num_cpus
+        init_tracefile(&argc, &argv);
+        if(num_cpus > MAX_CPUS)
+            throw runtime_error("Error, too many CPUs");
+
+        // the whole trace is decoded first, the tree needs the number of accesses
+        vector<vector<TraceFile::Entry> > traces(num_cpus);
+        vector<TraceFile::Entry> interleaved; // round robin like the simulators take them
+        vector<uint64_t> nops(num_cpus, 0);
+        while(!tracefile_ptr->eof()){
+            for(uint32_t i = 0; i < num_cpus; ++i){
+                if(tracefile_ptr->finished(i)) continue;
+                TraceFile::Entry e;
+                if(!tracefile_ptr->next(i, e))
+                    throw runtime_error("Error, unable to read the tracefile");
+                if(e.type == TraceFile::ENTRY_TYPE_NOP){
+                    if(!tracefile_ptr->finished(i)) ++nops[i]; // the end of the trace comes as a NOP
+                    continue;
+                }
+                traces[i].push_back(e);
+                interleaved.push_back(e);
+            }
+        }
+
+        FILE* f = NULL;
+        if(csv != NULL){
+            f = fopen(csv, "w");
+            if(f == NULL)
+                throw runtime_error(string("Error, unable to write ") + csv);
+            fprintf(f, "cpu,window,lines\n");
+        }
+
+        vector<ReuseDistance*> distances;
+        unordered_map<uint32_t, sharing_t> sharing;
+        printf("CPU\tReads\tWrites\tNOPs\tRead%%\tLines\tWSSAvg\tWSSMax\n");
+        for(uint32_t i = 0; i < num_cpus; ++i){
+            const vector<TraceFile::Entry>& t = traces[i];
+            ReuseDistance* d = new ReuseDistance(t.size());
+            distances.push_back(d);
+            uint64_t reads = 0;
+            unordered_set<uint32_t> footprint;
+            unordered_set<uint32_t> working_set;
+            uint64_t windows = 0, wss_sum = 0, wss_max = 0;
+            for(size_t k = 0; k < t.size(); ++k){
+                uint32_t line = t[k].addr / CACHELINE_SIZE;
+                bool write = t[k].type == TraceFile::ENTRY_TYPE_WRITE;
+                if(!write) ++reads;
+                d->access(line);
+                footprint.insert(line);
+                working_set.insert(line);
+                sharing_t& s = sharing[line];
+                (write ? s.writers : s.readers) |= 1ULL << i;
+                // the last window of the trace counts even if it's shorter
+                if((k + 1) % window == 0 || k + 1 == t.size()){
+                    if(f != NULL)
+                        fprintf(f, "%u,%lu,%lu\n", i, (unsigned long)windows, (unsigned long)working_set.size());
+                    ++windows;
+                    wss_sum += working_set.size();
+                    wss_max = max(wss_max, (uint64_t)working_set.size());
+                    working_set.clear();
+                }
+            }
+            printf("%u\t%lu\t%lu\t%lu\t%f\t%lu\t%f\t%lu\n", i, (unsigned long)reads, (unsigned long)(t.size() - reads),
+                   (unsigned long)nops[i], t.empty() ? 0.0 : 100.0 * reads / t.size(), (unsigned long)footprint.size(),
+                   windows ? (double)wss_sum / windows : 0.0, (unsigned long)wss_max);
+        }
+        if(f != NULL)
+            fclose(f);
+        ReuseDistance all(interleaved.size());
+        for(size_t k = 0; k < interleaved.size(); ++k)
+            all.access(interleaved[k].addr / CACHELINE_SIZE);
+
+        // histograms, one column per CPU and one for all of them
+        printf("Reuse distance histogram (lines)\nDistance");
+        for(uint32_t i = 0; i < num_cpus; ++i)
+            printf("\tCPU%u", i);
+        printf("\tAll\n");
+        printf("cold");
+        for(uint32_t i = 0; i < num_cpus; ++i)
+            printf("\t%lu", (unsigned long)distances[i]->cold);
+        printf("\t%lu\n", (unsigned long)all.cold);
+        for(int b = 0; b < DISTANCE_BUCKETS; ++b){
+            bool empty = all.histogram[b] == 0;
+            for(uint32_t i = 0; i < num_cpus; ++i)
+                empty = empty && distances[i]->histogram[b] == 0;
+            if(empty) continue;
+            if(b <= 1)
+                printf("%d", b);
+            else
+                printf("%lu-%lu", 1UL << (b - 1), (1UL << b) - 1);
+            for(uint32_t i = 0; i < num_cpus; ++i)
+                printf("\t%lu", (unsigned long)distances[i]->histogram[b]);
+            printf("\t%lu\n", (unsigned long)all.histogram[b]);
+        }
+
+        // miss rates in percent, "All" is one cache shared by every CPU
+        printf("Fully associative LRU miss rate (%%)\nSize");
+        for(uint32_t i = 0; i < num_cpus; ++i)
+            printf("\tCPU%u", i);
+        printf("\tAll\n");
+        for(int k = CURVE_MIN; k <= CURVE_MAX; ++k){
+            unsigned long bytes = (1UL << k) * CACHELINE_SIZE;
+            if(bytes < 1024)
+                printf("%luB", bytes);
+            else
+                printf("%luKB", bytes / 1024);
+            for(uint32_t i = 0; i < num_cpus; ++i)
+                printf("\t%f", traces[i].empty() ? 0.0 : 100.0 * distances[i]->misses(k) / traces[i].size());
+            printf("\t%f\n", interleaved.empty() ? 0.0 : 100.0 * all.misses(k) / interleaved.size());
+        }
+
+        // sharing of lines between CPUs
+        vector<uint64_t> by_cpus(num_cpus + 1, 0), written(num_cpus + 1, 0);
+        uint64_t shared_accesses = 0;
+        for(unordered_map<uint32_t, sharing_t>::iterator it = sharing.begin(); it != sharing.end(); ++it){
+            int n = bits(it->second.readers | it->second.writers);
+            ++by_cpus[n];
+            if(it->second.writers != 0) ++written[n];
+        }
+        for(size_t k = 0; k < interleaved.size(); ++k){
+            const sharing_t& s = sharing[interleaved[k].addr / CACHELINE_SIZE];
+            if(bits(s.readers | s.writers) > 1) ++shared_accesses;
+        }
+        printf("Sharers\tLines\tWritten\tReadOnly\n");
+        for(uint32_t n = 1; n <= num_cpus; ++n)
+            if(by_cpus[n] != 0)
+                printf("%u\t%lu\t%lu\t%lu\n", n, (unsigned long)by_cpus[n], (unsigned long)written[n],
+                       (unsigned long)(by_cpus[n] - written[n]));
+        printf("Accesses to shared lines %lu of %lu (%f%%)\n", (unsigned long)shared_accesses,
+               (unsigned long)interleaved.size(), interleaved.empty() ? 0.0 : 100.0 * shared_accesses / interleaved.size());
+
+        for(uint32_t i = 0; i < num_cpus; ++i)
+            delete distances[i];
+    }
+
+    catch (exception& e){
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * File: tracecapture.cpp
+ *
+ * Example of a program which captures its own trace with psa_capture.h.
+ * Threads count the values of a shared array into private histograms and
+ * add them to the shared histogram under a lock, a small map-reduce with
+ * private data, read sharing and a contended reduction.
+ *   tracecapture.bin <output tracefile> <threads> [elements]
+ * The tracefile runs on the simulators like the ones in tracefiles/.
+ */
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <stdlib.h>
+#include "psa_capture.h"
+
+using namespace std;
+
+static const int BINS = 64;
+
+static void count(int pid, int threads, const vector<int>& data, int* shared_bins, mutex& lock)
+{
+    psa_capture_thread(pid);
+    int bins[BINS] = {0};
+    size_t begin = data.size() * pid / threads;
+    size_t end = data.size() * (pid + 1) / threads;
+    for(size_t i = begin; i < end; ++i){
+        int bin = PSA_LOAD(data[i]) % BINS;
+        PSA_STORE(bins[bin], PSA_LOAD(bins[bin]) + 1);
+        psa_capture_compute(2); // the modulo and the loop
+    }
+    lock_guard<mutex> guard(lock);
+    for(int b = 0; b < BINS; ++b)
+        PSA_STORE(shared_bins[b], PSA_LOAD(shared_bins[b]) + PSA_LOAD(bins[b]));
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        if(argc < 3)
+            throw runtime_error(string("Error, usage: ") + argv[0] + " <output tracefile> <threads> [elements]");
+        int threads = atoi(argv[2]);
+        size_t elements = argc > 3 ? strtoull(argv[3], NULL, 10) : 65536;
+        if(threads < 1)
+            throw runtime_error("Error, at least one thread is needed");
+
+        vector<int> data(elements);
+        for(size_t i = 0; i < elements; ++i)
+            data[i] = rand();
+        int shared_bins[BINS] = {0};
+        mutex lock;
+
+        psa_capture_begin(argv[1], threads);
+        vector<thread> workers;
+        for(int i = 0; i < threads; ++i)
+            workers.push_back(thread(count, i, threads, std::cref(data), shared_bins, std::ref(lock)));
+        for(int i = 0; i < threads; ++i)
+            workers[i].join();
+        TraceWriter* writer = psa_capture_writer();
+        for(int i = 0; i < threads; ++i)
+            cout << "Thread " << i << ": " << writer->entries(i) << " entries" << endl;
+        psa_capture_end();
+
+        long total = 0;
+        for(int b = 0; b < BINS; ++b)
+            total += shared_bins[b];
+        cout << "Counted " << total << " values, trace written to " << argv[1] << endl;
+    }
+
+    catch (exception& e){
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}